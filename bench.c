@@ -0,0 +1,655 @@
+/*** includes ***/
+
+// The editor is built into the benchmark whole, its main renamed out of the way
+#define main flitMain
+#include "flit.c"
+#undef main
+
+#include <sys/wait.h>
+
+/*
+ * Headless benchmark. Each corpus is generated into a temporary directory &
+ * benchmarked in a child process of its own, so every run starts from a
+ * fresh editor. The child's terminal is a pseudo-terminal whose output a
+ * thread drains & throws away, & its keyboard is a pipe the keystrokes are
+ * written into, so keys go through the same decoding & drawing as they do
+ * in a terminal. One JSON object per line is written for each measurement.
+ * A check that edits leave the same highlighting as highlighting afresh
+ * would runs last, & fails the run if they don't.
+ *
+ * Usage: flt-bench [-o results.jsonl] [-l label] [-t trace] [-s]
+ *   -t replays a recorded trace, the raw bytes a terminal sent (as written by
+ *      `script --log-in`), instead of the synthetic one. Its pastes must fit
+ *      in BENCH_PIPE_SIZE.
+ *   -s also runs the stress check of a file over 4 GiB, which needs about
+ *      9 GiB of disk & 3 GiB of memory free.
+ */
+
+/*** defines ***/
+
+#define BENCH_ROWS 40
+#define BENCH_COLS 120
+#define BENCH_PIPE_SIZE (1 << 20)   // Keyboard pipe, which a whole paste must fit in
+#define BENCH_PASTE_BYTES (1 << 19)
+#define BENCH_STRESS_LINE ((1LL << 31) + (1 << 20)) // First line of the stress file, past INT_MAX
+#define BENCH_STRESS_BYTES (4400LL << 20)           // The stress file's size, near enough
+#define BENCH_STRESS_ROW (1 << 16)                  // Its other rows, but for a short last one
+#define BENCH_STRESS_TEXT "0123456789abcdef"        // Repeated to fill its rows
+
+/*** data ***/
+
+struct benchCorpus {
+    const char* name;
+    const char* file;
+    void (*generate)(FILE* fp);
+    const char* query;              // Searched for once loaded
+    int long_line;                  // Keys are typed on the first line rather than paging down
+};
+
+struct benchConfig {
+    FILE* out;
+    const char* label;
+    char* trace;                    // Recorded keys, NULL for the synthetic ones
+    size_t trace_len;
+    const char* dir;
+    int stress;                     // Run the stress check too
+};
+
+struct benchConfig B;
+
+/*** corpora ***/
+
+void benchGenerateHuge(FILE* fp) {
+    for (int j = 0; j < 1000000; j++) {
+        switch (j % 5) {
+            case 0: fprintf(fp, "int value_%d = compute(%d, buffer[%d]);\n", j, j % 97, j % 13); break;
+            case 1: fprintf(fp, "    if (value_%d > 42) return \"done %d\";\n", j - 1, j); break;
+            case 2: fprintf(fp, "    // step %d of the pipeline\n", j); break;
+            case 3: fprintf(fp, "    total += value_%d * 3.5;\n", j - 3); break;
+            default: fprintf(fp, "\n"); break;
+        }
+    }
+}
+
+void benchGenerateLongLine(FILE* fp) {
+    fputc('[', fp);
+    for (int j = 0; j < 60000; j++) {
+        fprintf(fp, "%s{\"id\":%d,\"name\":\"item %d\",\"tags\":[\"a\",\"b\"],\"score\":%d.5}",
+            j ? "," : "", j, j, j % 1000);
+    }
+    fputs("]\n", fp);
+}
+
+void benchGenerateTabs(FILE* fp) {
+    for (int j = 0; j < 200000; j++) {
+        int depth = j % 6;
+        for (int k = 0; k < depth; k++) fputc('\t', fp);
+        fprintf(fp, "field_%d\t%d\t\tvalue\t%d\n", j, j * 7, j % 31);
+    }
+}
+
+void benchGenerateComments(FILE* fp) {
+    for (int j = 0; j < 200000; j++) {
+        switch (j % 8) {
+            case 0: fprintf(fp, "/* block %d opens here\n", j); break;
+            case 1: fprintf(fp, " * and carries on with \"quotes\" and 123\n"); break;
+            case 2: fprintf(fp, " * until it closes */ int after_%d = %d;\n", j, j); break;
+            case 3: fprintf(fp, "char* s_%d = \"/* not a comment */\"; // trailing\n", j); break;
+            default: fprintf(fp, "while (x_%d < %d) { x_%d++; } /* inline */\n", j, j, j); break;
+        }
+    }
+}
+
+/// @brief A file over 4 GiB: one line longer than 2^31 bytes, rows of 64 KiB
+/// up past 4 GiB, then a short last row
+void benchGenerateStress(FILE* fp) {
+    static char chunk[1 << 20];
+    for (size_t j = 0; j < sizeof(chunk); j++) chunk[j] = BENCH_STRESS_TEXT[j % 16];
+
+    for (long long n = 0; n < BENCH_STRESS_LINE; n += sizeof(chunk)) fwrite(chunk, 1, sizeof(chunk), fp);
+    fputc('\n', fp);
+    for (long long n = BENCH_STRESS_LINE + 1; n < BENCH_STRESS_BYTES; n += BENCH_STRESS_ROW) {
+        fwrite(chunk, 1, BENCH_STRESS_ROW - 1, fp);
+        fputc('\n', fp);
+    }
+    fputs("last\n", fp);
+}
+
+/// @brief Short lines of code & comments, for checking highlighting after edits
+void benchGenerateCheck(FILE* fp) {
+    for (int j = 0; j < 200; j++) {
+        if (j % 20 == 5) fprintf(fp, "/* note %d */\n", j);
+        else fprintf(fp, "int check_%d = %d; // row\n", j, j);
+    }
+}
+
+struct benchCorpus corpora[] = {
+    {"huge", "huge.c", benchGenerateHuge, "value_99999", 0},
+    {"long_line", "long_line.json", benchGenerateLongLine, "item 59999", 1},
+    {"tabs", "tabs.c", benchGenerateTabs, "field_150000", 0},
+    {"comments", "comments.c", benchGenerateComments, "after_123458", 0},
+};
+
+#define BENCH_CORPORA (sizeof(corpora) / sizeof(corpora[0]))
+
+struct benchCorpus check_corpus = {"check", "check.c", benchGenerateCheck, NULL, 0};
+struct benchCorpus stress_corpus = {"over_4g", "over_4g.txt", benchGenerateStress, NULL, 1};
+
+/*** measurement ***/
+
+double benchNow() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int benchCmpDouble(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/// @brief Value below which pct percent of the sorted samples fall
+double benchPercentile(double* sorted, int n, double pct) {
+    if (n == 0) return 0;
+    int k = (int)(pct / 100 * (n - 1) + 0.5);
+    return sorted[k];
+}
+
+/// @brief Write s as a JSON string
+void benchString(const char* s) {
+    fputc('"', B.out);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') fprintf(B.out, "\\%c", c);
+        else if (c < 0x20) fprintf(B.out, "\\u%04x", c);
+        else fputc(c, B.out);
+    }
+    fputc('"', B.out);
+}
+
+/// @brief Start a result line for a measurement of the current corpus
+void benchBegin(const char* corpus, const char* metric) {
+    fprintf(B.out, "{\"version\":");
+    benchString(VERSION);
+    fprintf(B.out, ",\"label\":");
+    benchString(B.label);
+    fprintf(B.out, ",\"corpus\":");
+    benchString(corpus);
+    fprintf(B.out, ",\"metric\":");
+    benchString(metric);
+}
+
+void benchField(const char* name, double value) {
+    fprintf(B.out, ",\"%s\":%.3f", name, value);
+}
+
+/// @brief Write a count or size, which has no fraction
+void benchInt(const char* name, long long value) {
+    fprintf(B.out, ",\"%s\":%lld", name, value);
+}
+
+void benchEnd() {
+    fprintf(B.out, "}\n");
+    fflush(B.out);
+}
+
+/// @brief Write the percentiles of n samples as fields of the current result line
+void benchDistribution(double* samples, int n) {
+    qsort(samples, n, sizeof(double), benchCmpDouble);
+    benchInt("count", n);
+    benchField("p50", benchPercentile(samples, n, 50));
+    benchField("p90", benchPercentile(samples, n, 90));
+    benchField("p99", benchPercentile(samples, n, 99));
+    benchField("max", n ? samples[n - 1] : 0);
+}
+
+/*** virtual terminal ***/
+
+int bench_keys = -1;    // Write end of the editor's keyboard
+
+void* benchDrain(void* arg) {
+    int fd = *(int*)arg;
+    char buf[65536];
+    while (read(fd, buf, sizeof(buf)) > 0);
+    return NULL;
+}
+
+/// @brief Give the editor a pseudo-terminal of BENCH_ROWS x BENCH_COLS to
+/// draw on, drained by a thread, & a pipe for a keyboard
+void benchTerminal() {
+    static int master;
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1) fail("posix_openpt");
+    int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+    if (slave == -1) fail("open pty");
+
+    struct termios raw;
+    tcgetattr(slave, &raw);
+    cfmakeraw(&raw);
+    tcsetattr(slave, TCSANOW, &raw);
+    struct winsize ws = {BENCH_ROWS, BENCH_COLS, 0, 0};
+    ioctl(master, TIOCSWINSZ, &ws);
+    dup2(slave, STDOUT_FILENO);
+    close(slave);
+
+    pthread_t drain;
+    if (pthread_create(&drain, NULL, benchDrain, &master) != 0) fail("pthread_create");
+
+    int keys[2];
+    if (pipe(keys) == -1) fail("pipe");
+    fcntl(keys[1], F_SETPIPE_SZ, BENCH_PIPE_SIZE);
+    fcntl(keys[1], F_SETFL, O_NONBLOCK);
+    fcntl(keys[0], F_SETFL, O_NONBLOCK); // Reads return at once, as they do in raw mode
+    dup2(keys[0], STDIN_FILENO);
+    close(keys[0]);
+    bench_keys = keys[1];
+}
+
+/*** replay ***/
+
+/// @brief Press every key of a trace, drawing after each, as a user typing
+/// one key at a time would see. The keyboard is topped up between keys.
+void benchReplay(const char* corpus, const char* trace, size_t len) {
+    int cap = 1024, n = 0;
+    double* latency = malloc(sizeof(double) * cap);
+    double* bytes = malloc(sizeof(double) * cap);
+    if (latency == NULL || bytes == NULL) fail("malloc");
+
+    size_t sent = 0;
+    for (;;) {
+        while (sent < len) {
+            ssize_t w = write(bench_keys, trace + sent, len - sent);
+            if (w <= 0) break;
+            sent += w;
+        }
+        if (sent == len && !editorKeyPending()) break;
+
+        double start = benchNow();
+        editorHandleKeyPress();
+        editorRefreshScreen();
+        double took = benchNow() - start;
+
+        if (n == cap) {
+            cap *= 2;
+            latency = realloc(latency, sizeof(double) * cap);
+            bytes = realloc(bytes, sizeof(double) * cap);
+            if (latency == NULL || bytes == NULL) fail("realloc");
+        }
+        latency[n] = took * 1e6;
+        bytes[n] = E.frame_bytes;
+        n++;
+    }
+
+    benchBegin(corpus, "key_latency_us");
+    benchDistribution(latency, n);
+    benchEnd();
+
+    benchBegin(corpus, "frame_bytes");
+    double total = 0;
+    for (int j = 0; j < n; j++) total += bytes[j];
+    benchField("mean", n ? total / n : 0);
+    benchDistribution(bytes, n);
+    benchEnd();
+
+    free(latency);
+    free(bytes);
+}
+
+/// @brief Append a key's bytes to a growing trace
+void benchPress(struct abuf* trace, const char* key, int times) {
+    while (times--) abAppend(trace, key, strlen(key));
+}
+
+/// @brief Keystrokes of an editing session: paging into the file, typing a
+/// line, correcting it & moving about
+void benchSyntheticTrace(struct abuf* trace, int long_line) {
+    for (int round = 0; round < 8; round++) {
+        if (long_line) {
+            benchPress(trace, "\x1b[C", 40);                // Right
+        } else {
+            benchPress(trace, "\x1b[6~", 6);                // Page down
+            benchPress(trace, "\x1b[B", 5);                 // Down
+        }
+        benchPress(trace, "int total = count * 2; /* sum */ \"s\"", 1);
+        benchPress(trace, "\x7f", 12);                      // Backspace
+        benchPress(trace, "\t", 1);
+        if (!long_line) benchPress(trace, "\r", 1);
+        benchPress(trace, "\x1b[D", 10);                    // Left
+        benchPress(trace, "\x1b[A", 3);                     // Up
+        if (!long_line) benchPress(trace, "\x1b[5~", 2);    // Page up
+    }
+}
+
+/// @brief Paste a block of lines as a terminal would, in one bracketed paste
+void benchPaste(const char* corpus) {
+    struct abuf trace = ABUF_INIT;
+    benchPress(&trace, "\x1b[200~", 1);
+    while (trace.len < BENCH_PASTE_BYTES)
+        benchPress(&trace, "static int pasted(int a) { return a * 2; } // pasted\r", 1);
+    benchPress(&trace, "\x1b[201~", 1);
+
+    ssize_t rows = E.numrows;
+    if (write(bench_keys, trace.b, trace.len) != trace.len) fail("write");
+
+    double start = benchNow();
+    editorHandleKeyPress();
+    editorRefreshScreen();
+    double took = benchNow() - start;
+
+    benchBegin(corpus, "paste");
+    benchField("ms", took * 1e3);
+    benchInt("bytes", trace.len);
+    benchInt("rows_added", E.numrows - rows);
+    benchEnd();
+    abFree(&trace);
+}
+
+/// @brief Time a search until its first match is drawn & until its index is complete
+void benchSearch(const char* corpus, const char* query) {
+    double start = benchNow();
+    editorSearchStart((char*)query);
+    struct search* s = E.search;
+    do {
+        editorSearchSeek(1, 0, 0);
+    } while (s->pending);
+    editorRefreshScreen();
+    double first = benchNow() - start;
+
+    int done = 0;
+    while (!done) {
+        pthread_mutex_lock(&s->lock);
+        done = s->done || s->full;
+        pthread_mutex_unlock(&s->lock);
+        if (!done) sched_yield();
+    }
+    double all = benchNow() - start;
+
+    benchBegin(corpus, "search");
+    benchField("first_match_ms", first * 1e3);
+    benchField("indexed_ms", all * 1e3);
+    benchInt("matches", s->nmatches);
+    benchEnd();
+    editorSearchStop();
+}
+
+/*** runs ***/
+
+/// @brief Benchmark one corpus in the current process, which it leaves spent
+/// @return 0, the measurements having no way to fail
+int benchCorpus(struct benchCorpus* c) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", B.dir, c->file);
+    struct stat st;
+    stat(path, &st);
+
+    benchTerminal();
+    initEditor();
+
+    double start = benchNow();
+    editorOpen(path);
+    editorRefreshScreen();
+    double first = benchNow() - start;
+    editorLoadFinish();
+    double loaded = benchNow() - start;
+
+    // Every row is prepared, as drawing them all would
+    for (ssize_t y = 0; y < E.numrows; y++) editorPrepareRow(y);
+    size_t row_bytes = 0;
+    for (ssize_t y = 0; y < E.numrows; y++) row_bytes += editorRowBytes(editorRowAt(y));
+    double prepared = benchNow() - start;
+
+    benchBegin(c->name, "open");
+    benchInt("file_bytes", st.st_size);
+    benchInt("rows", E.numrows);
+    benchField("first_frame_ms", first * 1e3);
+    benchField("loaded_ms", loaded * 1e3);
+    benchField("highlighted_ms", prepared * 1e3);
+    benchField("row_bytes_per_line", E.numrows ? (double)row_bytes / E.numrows : 0);
+    benchEnd();
+
+    benchSearch(c->name, c->query);
+
+    E.cx = E.cy = 0;
+    E.rowoff = E.coloff = 0;
+    if (B.trace) {
+        benchReplay(c->name, B.trace, B.trace_len);
+    } else {
+        struct abuf trace = ABUF_INIT;
+        benchSyntheticTrace(&trace, c->long_line);
+        benchReplay(c->name, trace.b, trace.len);
+        abFree(&trace);
+    }
+
+    benchPaste(c->name);
+
+    start = benchNow();
+    editorSave();
+    benchBegin(c->name, "save");
+    benchField("ms", (benchNow() - start) * 1e3);
+    benchEnd();
+
+    journalClose(1);
+    return 0;
+}
+
+/// @brief Compare every row's hl with what highlighting the whole buffer
+/// afresh gives. Rows are drawn from the bottom up first, so each is drawn
+/// before the rows above it, as after jumping to the end of the file.
+/// @return the first row that differs, or -1 if none does
+ssize_t benchHlMismatch() {
+    unsigned char** seen = malloc(sizeof(unsigned char*) * E.numrows);
+    if (seen == NULL) fail("malloc");
+    for (ssize_t y = E.numrows - 1; y >= 0; y--) {
+        erow* row = editorPrepareRow(y);
+        seen[y] = malloc(row->rsize + 1);
+        if (seen[y] == NULL) fail("malloc");
+        editorRowUnpackHl(row, seen[y]);
+    }
+
+    for (ssize_t y = 0; y < E.numrows; y++) editorRowAt(y)->stale |= ROW_STALE_HL | ROW_STALE_STATE;
+    E.hl_stale_from = 0;
+
+    ssize_t bad = -1;
+    for (ssize_t y = 0; y < E.numrows; y++) {
+        erow* row = editorPrepareRow(y);
+        unsigned char* fresh = editorHlScratch(row->rsize);
+        editorRowUnpackHl(row, fresh);
+        if (bad == -1 && memcmp(seen[y], fresh, row->rsize)) bad = y;
+        free(seen[y]);
+    }
+
+    free(seen);
+    return bad;
+}
+
+/// @brief Check the highlighting that edits leave behind against highlighting
+/// from scratch, after pastes that open & close block comments across rows
+/// @return 0 if every row matches, 1 otherwise
+int benchCheck(struct benchCorpus* c) {
+    static const char* pastes[] = {
+        "\x1b[200~\r/* open\rmore\x1b[201~",             // Opens a comment over the rest
+        "\x1b[200~ */ int closed;\rint x;\x1b[201~",      // Closes it again
+        "\x1b[200~/*\r\r\x1b[201~",
+        "\x1b[200~a\rb */ c\rd /* e\x1b[201~",
+    };
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", B.dir, c->file);
+
+    benchTerminal();
+    initEditor();
+    editorOpen(path);
+    editorLoadFinish();
+    benchHlMismatch();
+
+    ssize_t bad = -1;
+    int done = 0;
+    for (unsigned int k = 0; k < sizeof(pastes) / sizeof(pastes[0]) && bad == -1; k++, done++) {
+        E.cy = 10 + 30 * k;
+        E.cx = editorRowAt(E.cy)->size;
+        editorRefreshScreen(); // Highlights the rows in view, as typing would have
+        if (write(bench_keys, pastes[k], strlen(pastes[k])) == -1) fail("write");
+        editorHandleKeyPress();
+        bad = benchHlMismatch();
+    }
+
+    benchBegin(c->name, "highlight_after_paste");
+    benchInt("pastes", done);
+    benchInt("mismatched_row", bad);
+    benchInt("ok", bad == -1);
+    benchEnd();
+
+    journalClose(1);
+    return bad != -1;
+}
+
+/// @brief Read the byte at offset `at` of a file
+int benchByteAt(const char* path, off_t at) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+    unsigned char c;
+    ssize_t n = pread(fd, &c, 1, at);
+    close(fd);
+    return n == 1 ? c : -1;
+}
+
+/// @brief Open, edit & save the stress file, checking that a char typed past
+/// 2^31 in its first line & one typed in its last row, past 4 GiB, are saved
+/// where they were typed & that nothing else is gained or lost
+/// @return 0 if the saved file is right, 1 otherwise
+int benchStress(struct benchCorpus* c) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", B.dir, c->file);
+    struct stat before, after;
+    if (stat(path, &before) == -1) fail(path);
+
+    benchTerminal();
+    initEditor();
+
+    double start = benchNow();
+    editorOpen(path);
+    editorLoadFinish();
+    double loaded = benchNow() - start;
+    ssize_t rows = E.numrows;
+
+    off_t first_at = (1LL << 31) + 5;
+    E.cy = 0;
+    E.cx = first_at;
+    editorInsertChar('X');
+
+    // In the saved file the last row starts a byte further on, after the X
+    off_t last_at = before.st_size - (off_t)strlen("last\n") + 1 + 2;
+    E.cy = E.numrows - 1;
+    E.cx = 2;
+    editorInsertChar('Y');
+    double edited = benchNow() - start;
+
+    start = benchNow();
+    editorSave();
+    double saved = benchNow() - start;
+
+    int ok = stat(path, &after) == 0 && after.st_size == before.st_size + 2 &&
+        benchByteAt(path, first_at - 1) == BENCH_STRESS_TEXT[(first_at - 1) % 16] &&
+        benchByteAt(path, first_at) == 'X' &&
+        benchByteAt(path, first_at + 1) == BENCH_STRESS_TEXT[first_at % 16] &&
+        benchByteAt(path, last_at - 1) == 'a' && benchByteAt(path, last_at) == 'Y' &&
+        benchByteAt(path, last_at + 1) == 's';
+
+    benchBegin(c->name, "stress");
+    benchInt("file_bytes", before.st_size);
+    benchInt("rows", rows);
+    benchField("loaded_ms", loaded * 1e3);
+    benchField("edited_ms", edited * 1e3);
+    benchField("save_ms", saved * 1e3);
+    benchInt("ok", ok);
+    benchEnd();
+
+    journalClose(1);
+    return !ok;
+}
+
+/// @brief Read a whole file into memory
+char* benchSlurp(const char* path, size_t* len) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) return NULL;
+    struct abuf buf = ABUF_INIT;
+    char chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) abAppend(&buf, chunk, n);
+    fclose(fp);
+    *len = buf.len;
+    return buf.b;
+}
+
+/// @brief Generate a corpus & run it in a child process of its own
+/// @return 0 if the child succeeded, 1 otherwise
+int benchRun(struct benchCorpus* c, int (*run)(struct benchCorpus*)) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", B.dir, c->file);
+    FILE* fp = fopen(path, "w");
+    if (fp == NULL) fail(path);
+    c->generate(fp);
+    if (ferror(fp) | fclose(fp)) fail(path);
+
+    pid_t pid = fork();
+    if (pid == -1) fail("fork");
+    if (pid == 0) {
+        int status = run(c);
+        fflush(B.out);
+        profClose(); // _exit skips the atexit handler finishing a FLIT_TRACE trace
+        _exit(status);
+    }
+
+    int st;
+    waitpid(pid, &st, 0);
+    unlink(path);
+    if (!WIFEXITED(st) || WEXITSTATUS(st) != 0) {
+        fprintf(stderr, "flt-bench: %s failed\n", c->name);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    B.out = stdout;
+    B.label = "";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "o:l:t:s")) != -1) {
+        switch (opt) {
+            case 'o':
+                B.out = fopen(optarg, "w");
+                if (B.out == NULL) fail(optarg);
+                break;
+            case 'l':
+                B.label = optarg;
+                break;
+            case 't':
+                B.trace = benchSlurp(optarg, &B.trace_len);
+                if (B.trace == NULL) fail(optarg);
+                break;
+            case 's':
+                B.stress = 1;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-o results.jsonl] [-l label] [-t trace] [-s]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    // Results are written to a copy of stdout, which the editor takes over
+    int out = dup(fileno(B.out));
+    if (out == -1) fail("dup");
+    B.out = fdopen(out, "w");
+
+    char dir[] = "/tmp/flit-bench-XXXXXX";
+    if (mkdtemp(dir) == NULL) fail("mkdtemp");
+    B.dir = dir;
+
+    int status = 0;
+    for (unsigned int j = 0; j < BENCH_CORPORA; j++) status |= benchRun(&corpora[j], benchCorpus);
+    status |= benchRun(&check_corpus, benchCheck);
+    if (B.stress) status |= benchRun(&stress_corpus, benchStress);
+
+    rmdir(dir);
+    return status;
+}
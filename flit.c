@@ -7,16 +7,27 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /*** defines ***/
 
 #define VERSION "0.2.2"
@@ -33,9 +44,17 @@ enum editorKey {
     DOWN,
     DEL,
     P_UP,
-    P_DOWN
+    P_DOWN,
+    PASTE,      // A bracketed paste, its text left in E.paste
+    NO_KEY      // No key arrived before the wait timed out
 };
 
+#define INPUT_BUFSIZE 4096
+#define ESC_WAIT_MS 50      // How long the rest of an escape sequence may lag its ESC
+#define PROMPT_TICK_MS 100  // How often a prompt wakes to show background progress
+#define PASTE_WAIT_MS 1000  // How long a bracketed paste may stall before it is cut off
+#define LINE_COMPACT_IDLE_MS 1000 // How long input must pause before line storage is compacted
+
 enum editorHighlight {
     HL_NORMAL = 0,
     HL_COMMENT,
@@ -50,8 +69,29 @@ enum editorHighlight {
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
+#define CELL_FG_DEFAULT 39
+#define CELL_REVERSE  (1<<0)
+#define CELL_SELECTED (1<<1)
+
+#define ROW_STALE_RENDER (1<<0)
+#define ROW_STALE_HL     (1<<1)
+#define ROW_STALE_STATE  (1<<2) // hl_open_comment
+
 /*** data ***/
 
+struct keyword {
+    const char* word;   // NULL for an empty slot
+    int len;
+    unsigned char hl;   // HL_KEYWORD1 or HL_KEYWORD2
+};
+
+struct keywordTable {
+    struct keyword* slots;
+    unsigned int mask;  // Slot count - 1, slot count being a power of two
+    unsigned int seed;  // Chosen so no two keywords share a slot
+    int maxlen;
+};
+
 struct editorSyntax {
     char* filetype;     // Name
     char** filematch;   // Pattern matches
@@ -60,41 +100,118 @@ struct editorSyntax {
     char* multiline_comment_start;
     char* multiline_comment_end;
     int flags;          // What to highlight
+    struct keywordTable* keyword_table; // keywords as a perfect hash, built on first use
 };
 
+struct rowblock;
+
+typedef struct rowTab {
+    ssize_t cx;             // Position of a tab in chars
+    ssize_t rx;             // Render column just after it
+} rowTab;
+
+typedef struct hlSpan {
+    unsigned int len : 29;  // Columns in the run
+    unsigned int hl : 3;    // Their editorHighlight
+} hlSpan;
+
+#define HL_SPAN_MAX ((1u << 29) - 1)
+
+/*
+ * What a row derives from its chars lives in one allocation, aux: the row's
+ * tabs, then its render if it has tabs, then its hl as runs. A row without
+ * tabs renders to its chars as they are, so it has no render of its own, and
+ * the runs stop at the last one that isn't HL_NORMAL. A plain row with no
+ * tabs therefore has no aux at all.
+ */
 typedef struct erow {
-    int idx;
-    int size;
-    int rsize;
+    struct rowblock* block; // Owning block. Row index is derived from the tree
+    ssize_t size;
+    ssize_t rsize;
     char* chars;
-    char* render;
-    unsigned char* hl;
+    void* aux;              // Tabs, render & hl runs, NULL if all are empty
+    ssize_t ntabs;
+    ssize_t nspans;
     int hl_open_comment;
+    int mapped;             // chars point into E.map rather than the heap
+    unsigned int copy_gen;  // Generation of the copy buffer sharing chars, 0 if none
+    int stale;              // ROW_STALE_* bits: what must be rebuilt before drawing
 } erow;
 
+typedef struct copySpan {
+    char* p;
+    ssize_t len;
+    int nl;                 // A newline follows the span
+} copySpan;
+
+/*
+ * The copy buffer holds spans of row text rather than a copy of it. Text in
+ * E.map never changes, and a heap row whose chars are shared is stamped with
+ * the buffer's generation: editing or freeing the row hands the old chars
+ * over to the buffer instead of changing or freeing them.
+ */
+typedef struct copyBuffer {
+    copySpan* spans;
+    int nspans;
+    int cap;
+    ssize_t len;            // Bytes the spans add up to, newlines included
+    char** owned;           // Chars handed over by rows, freed with the buffer
+    int nowned;
+    int owned_cap;
+    unsigned int gen;       // Stamp of the rows it shares
+} copyBuffer;
+
+typedef struct cell {
+    char ch;
+    unsigned char fg;   // SGR foreground colour
+    unsigned char attr; // CELL_* bits
+} cell;
+
 struct editorConfig {
-    int cx, cy;
-    int rx;
-    int rowoff;
-    int coloff;
+    ssize_t cx, cy;
+    ssize_t rx;
+    ssize_t rowoff;
+    ssize_t coloff;
     int screenrows;
     int screencols;
-    int numrows;
-    erow* row;
+    cell* frame;        // Frame being drawn, (screenrows + 2) x screencols
+    cell* shown;        // Frame currently on the terminal
+    int shown_valid;    // 0 forces the next refresh to repaint everything
+    int frame_bytes;    // Bytes written by the last refresh
+    int frame_allocs;   // Output buffer reallocations during the last refresh
+    ssize_t numrows;
+    struct rowblock* rows;      // Root of the row tree
+    struct rowblock* row_cache; // Block of the last row lookup
+    ssize_t row_cache_start;    // Row index of row_cache's first row
+    ssize_t hl_stale_from;      // Rows above this have an up to date hl_open_comment
     int dirty;
     char* filename;
+    char* map;          // Read-only mapping of the opened file
+    size_t map_len;
     char statusmsg[80];
     time_t statusmsg_time;
 
-    int dropped_cursor_x, dropped_cursor_y; // Inneficiency I know
-    int selection_start_x, selection_start_y; // Selection start
-    int selection_end_x, selection_end_y;     // Selection end
+    ssize_t dropped_cursor_x, dropped_cursor_y; // Inneficiency I know
+    ssize_t selection_start_x, selection_start_y; // Selection start
+    ssize_t selection_end_x, selection_end_y;     // Selection end
     int selecting;
-    char* copy_buffer;
-    int copy_buffer_len;
+    copyBuffer copy;
+
+    struct search* search;      // Incremental search in progress, NULL if none
+    struct journal* journal;    // Crash journal of the file's edits, NULL if none
+    struct loader* loader;      // Reader of the file's lines while it loads, NULL after
 
     struct editorSyntax *syntax;
     struct termios old_termios;
+
+    char input[INPUT_BUFSIZE];  // Bytes read from the terminal but not yet decoded
+    int input_pos;
+    int input_len;
+    int resize_pipe[2];         // Written by the SIGWINCH handler to wake poll
+    int load_pipe[2];           // Written by the loader when it has rows ready
+    char* paste;                // Text of the last bracketed paste
+    ssize_t paste_len;
+    ssize_t paste_cap;
 };
 
 struct editorConfig E;
@@ -131,19 +248,22 @@ struct editorSyntax HLDB[] = {
         C_HL_extensions,
         C_HL_keywords,
         "//", "/*", "*/",
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+        NULL
     }, {
         "md",
         MD_HL_extensions,
         MD_HL_keywords,
         NULL, "<!--", "-->",
+        0,
         NULL
     }, {
         "py",
         PY_HL_extensions,
         PY_HL_keywords,
         "#", NULL, NULL,
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+        NULL
     }
 };
 
@@ -151,9 +271,22 @@ struct editorSyntax HLDB[] = {
 
 /*** prototypes ***/
 
-void editorSetStatusMessage(const char* fmt, ...);
+void editorSetStatusMessage(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
 void editorRefreshScreen();
+void editorRenderRow(erow* row);
+void frameResize();
+void editorLoadPublish();
+void editorLoadFinish();
 char* editorPrompt(char* promt, void (*callback)(char*, int));
+void journalInsertRows(ssize_t at, const char* s, ssize_t len, const char* tail, ssize_t taillen);
+void journalDeleteRows(ssize_t at, ssize_t n);
+void journalSplice(ssize_t y, ssize_t x, ssize_t del, const char* s, ssize_t len);
+void journalOpen(const char* filename);
+void journalClose(int discard);
+int editorRowShared(erow* row);
+int lineCompactDue();
+int lineCompactRunning();
+void lineCompactStep();
 
 /*** terminal ***/
 
@@ -170,6 +303,7 @@ void fail(const char* s) {
 
 /// @brief Disable Raw Terminal Mode
 void disableRawMode() {
+    write(STDOUT_FILENO, "\x1b[?2004l", 8); // Bracketed paste off
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.old_termios) == -1){
         fail("tcsetattr");
     }
@@ -187,52 +321,13 @@ void enableRawMode() {
     raw.c_oflag &= ~(OPOST); // Disable output processing
     raw.c_cflag |= (CS8); // Character size: 8 bits per byte
     raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN); // Disabling echo, canon' input, signals, etc. NOT the bitflags
-    raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
+    raw.c_cc[VMIN] = 0;  // Reads never block: poll does the waiting
+    raw.c_cc[VTIME] = 0;
 
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) fail("tcsetattr"); // Apply change after pending output written to terminal
-}
-
-/// @brief Wait for one keypress & return it
-/// @return Pressed key
-int editorReadKey() {
-    int nread;
-    char c;
-
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (nread == -1 && errno != EAGAIN) fail("read");
-    }
-
-    if (c == '\x1b') {
-        char seq[3];
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
-
-        if (seq[0] == '[') {
-            if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
-                if (seq[2] == '~') {
-                    switch (seq[1]) {
-                        case '3': return DEL;
-                        case '5': return P_UP;
-                        case '6': return P_DOWN;
-                    }
-                }
-            } else {
-                switch (seq[1]) {
-                    case 'A': return UP;
-                    case 'B': return DOWN;
-                    case 'C': return RIGHT;
-                    case 'D': return LEFT;
-                }
-            }
-        }
-    
 
-    return '\x1b';
-    } else {
-        return c;
-    }
+    // Have pasted text framed by ESC[200~ & ESC[201~ rather than typed
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
 int getCursorPosition(int* rows, int* cols) {
@@ -241,8 +336,9 @@ int getCursorPosition(int* rows, int* cols) {
 
     if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
 
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
     while (i < sizeof(buf) - 1) {
-        if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
+        if (poll(&pfd, 1, 1000) != 1 || read(STDIN_FILENO, &buf[i], 1) != 1) break;
         if (buf[i] == 'R') break;
         i++;
     }
@@ -267,328 +363,2036 @@ int getWindowSize(int *rows, int *cols) {
     }
 }
 
-/** syntax highlighting ***/
+/*
+ * Input is read in bulk: poll waits on the terminal & on a pipe the SIGWINCH
+ * handler writes to, and everything the terminal has queued is then read in
+ * one go. Keys are decoded from that buffer, so the main loop can apply every
+ * key that is already waiting before it draws again.
+ */
+
+void handleSigwinch(int sig) {
+    (void)sig;
+    int saved = errno;
+    write(E.resize_pipe[1], "", 1);
+    errno = saved;
+}
 
-int is_separator(int c) {
-    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+/// @brief Pick up a new window size & redraw everything at it
+void editorHandleResize() {
+    char drain[64];
+    while (read(E.resize_pipe[0], drain, sizeof(drain)) > 0);
+
+    int rows, cols;
+    if (getWindowSize(&rows, &cols) == -1) return;
+    E.screenrows = rows - 2;
+    E.screencols = cols;
+    frameResize();
 }
 
-void editorUpdateSyntax(erow* row) {
-    row->hl = realloc(row->hl, row->rsize);
-    memset(row->hl, HL_NORMAL, row->rsize);
+/// @brief Read everything the terminal has ready onto the end of E.input
+void editorDrainInput() {
+    if (E.input_pos == E.input_len) {
+        E.input_pos = E.input_len = 0;
+    } else if (E.input_pos > 0) {
+        memmove(E.input, &E.input[E.input_pos], E.input_len - E.input_pos);
+        E.input_len -= E.input_pos;
+        E.input_pos = 0;
+    }
 
-    if (E.syntax == NULL) return;
+    while (E.input_len < INPUT_BUFSIZE) {
+        ssize_t n = read(STDIN_FILENO, &E.input[E.input_len], INPUT_BUFSIZE - E.input_len);
+        if (n == -1 && errno != EAGAIN && errno != EINTR) fail("read");
+        if (n <= 0) break;
+        E.input_len += n;
+    }
+}
 
-    char** keywords = E.syntax->keywords;
+/// @brief Wait up to timeout ms (-1 for ever) for more input, a resize or
+/// more of the file being loaded
+/// @return 1 if input was read, 0 on timeout, resize or load progress
+int editorFillInput(int timeout) {
+    struct pollfd fds[3] = {
+        {STDIN_FILENO, POLLIN, 0},
+        {E.resize_pipe[0], POLLIN, 0},
+        {E.load_pipe[0], POLLIN, 0}
+    };
+    if (poll(fds, 3, timeout) == -1) {
+        if (errno != EINTR) fail("poll");
+        return 0;
+    }
 
-    char* scs = E.syntax->singleline_comment_start;
-    char* mcs = E.syntax->multiline_comment_start;
-    char* mce = E.syntax->multiline_comment_end;
+    if (fds[1].revents & POLLIN) {
+        editorHandleResize();
+        return 0;
+    }
+    if (fds[2].revents & POLLIN) {
+        editorLoadPublish();
+        return 0;
+    }
+    if (!(fds[0].revents & POLLIN)) return 0;
 
-    int scs_len = scs ? strlen(scs) : 0;
-    int mcs_len = mcs ? strlen(mcs) : 0;
-    int mce_len = mce ? strlen(mce) : 0;
+    int had = E.input_len - E.input_pos;
+    editorDrainInput();
+    return E.input_len - E.input_pos > had;
+}
 
-    int prev_sep = 1;
-    int in_string = 0;
-      int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+/// @brief Wait up to timeout ms (-1 for ever) for input or a resize
+/// @return 1 if input is queued, 0 on timeout or resize
+int editorWaitInput(int timeout) {
+    if (E.input_pos < E.input_len) return 1;
+    editorFillInput(timeout);
+    return E.input_pos < E.input_len;
+}
 
-    int i = 0;
-    while(i < row->rsize) {
-        char c = row->render[i];
-        unsigned char prev_hl = (i > 0) ? row->hl[i-1] : HL_NORMAL;
+/// @brief Take the next byte of input, waiting up to timeout ms for it
+/// @return the byte, or -1 if none came
+int editorInputByte(int timeout) {
+    if (E.input_pos == E.input_len && !editorWaitInput(timeout)) return -1;
+    return (unsigned char)E.input[E.input_pos++];
+}
 
-        /* If single line comments */
-        if (scs_len && !in_string && !in_comment) {
-            if (!strncmp(&row->render[i], scs, scs_len)) {
-                memset(&row->hl[i], HL_COMMENT, row->size - i);
-                break;
-            }
-        }
+/// @brief Add pasted text to E.paste, as the newlines the rows expect
+void editorPasteAppend(char* s, ssize_t len) {
+    if (E.paste_len + len > E.paste_cap) {
+        ssize_t cap = E.paste_cap ? E.paste_cap : 4096;
+        while (cap < E.paste_len + len) cap *= 2;
+        E.paste = realloc(E.paste, cap);
+        if (E.paste == NULL) fail("realloc");
+        E.paste_cap = cap;
+    }
 
-        /* If multiline comments */
-        if (mcs_len && mce_len && !in_string) {
-            if (in_comment) {
-                row->hl[i] = HL_MLCOMMENT;
-                if (!strncmp(&row->render[i], mce, mce_len)) {
-                    memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-                    i += mce_len;
-                    in_comment = 0;
-                    prev_sep = 1;
-                    continue;
-                } else {
-                    i++;
-                    continue;
-                }
-            } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-                memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-                i += mcs_len;
-                in_comment = 1;
-                continue;
-            }
+    // Terminals send pasted line breaks as \r or \r\n
+    for (ssize_t j = 0; j < len; j++) {
+        if (s[j] != '\r') {
+            E.paste[E.paste_len++] = s[j];
+        } else if (j + 1 < len && s[j + 1] == '\n') {
+            continue;
+        } else {
+            E.paste[E.paste_len++] = '\n';
         }
+    }
+}
 
-        /* If String syntax flag set, highlight strings & characters */
-        if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-            if (in_string) {
-                row->hl[i] = HL_STRING;
-
-                if (c == '\\' && i + 1 < row->size) {
-                    row->hl[i + 1] = HL_STRING;
-                    i += 2;
-                    continue;
-                }
+/// @brief Collect a bracketed paste into E.paste, after its ESC[200~ has been
+/// read, up to the ESC[201~ closing it. The text is moved out of the input
+/// buffer in chunks rather than decoded as keys.
+void editorReadPaste() {
+    static const char end[] = "\x1b[201~";
+    const int endlen = sizeof(end) - 1;
+    E.paste_len = 0;
+
+    for (;;) {
+        char* queued = &E.input[E.input_pos];
+        int n = E.input_len - E.input_pos;
+        char* found = memmem(queued, n, end, endlen);
+        if (found) {
+            editorPasteAppend(queued, found - queued);
+            E.input_pos += found - queued + endlen;
+            return;
+        }
 
-                if (c == in_string) in_string = 0;
-                i++;
-                prev_sep = 1;
-                continue;
-            } else {
-                if (c == '"' || c == '\'') {
-                    in_string = c;
-                    row->hl[i] = HL_STRING;
-                    i++;
-                    continue;
-                }
-            }
+        // Keep back what could be the start of a split end marker, & a \r
+        // whose \n hasn't arrived yet
+        int keep = n < endlen - 1 ? n : endlen - 1;
+        while (keep > 0 && memchr(&queued[n - keep], '\x1b', keep) == NULL) keep--;
+        if (keep == 0 && n && queued[n - 1] == '\r') keep = 1;
+        editorPasteAppend(queued, n - keep);
+        E.input_pos += n - keep;
+
+        // Only PASTE_WAIT_MS without input ends the paste. A resize, more of
+        // the file loading or a signal just cuts one wait short.
+        struct timespec since, now;
+        clock_gettime(CLOCK_MONOTONIC, &since);
+        int waited = 0;
+        while (waited < PASTE_WAIT_MS && !editorFillInput(PASTE_WAIT_MS - waited)) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            waited = (now.tv_sec - since.tv_sec) * 1000 + (now.tv_nsec - since.tv_nsec) / 1000000;
         }
 
-        /* If Number syntax flag set, highlight numbers */
-        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-            if(isdigit(c) && (prev_sep || prev_hl == HL_NUMBER || (c == '.' && prev_hl == HL_NUMBER))) {
-                row->hl[i] = HL_NUMBER;
-                i++;
-                prev_sep;
-                continue;
-            }
+        if (waited >= PASTE_WAIT_MS) {
+            // The paste stalled without being closed: end it with what came
+            editorPasteAppend(&E.input[E.input_pos], E.input_len - E.input_pos);
+            E.input_pos = E.input_len;
+            return;
         }
+    }
+}
 
-        if(prev_sep) {
-            int j;
-            for(j = 0; keywords[j]; j++) {
-                int klen = strlen(keywords[j]);
-                int kw2 = keywords[j][klen-1] == '|';
-                if (kw2) klen--;
-
-                if (!strncmp(&row->render[i], keywords[j], klen) && is_separator(row->render[i+klen])) {
-                    memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-                    i += klen;
-                    break;
-                }
-            }
+/// @brief Whether input is waiting, without blocking
+int editorKeyPending() {
+    return editorWaitInput(0);
+}
 
-            if(keywords[j] != NULL) {
-                prev_sep = 0;
-                continue;
+/// @brief Read one keypress, waiting up to timeout ms (-1 for ever) for it
+/// @return Pressed key, or NO_KEY if none arrived, the window was resized or
+/// more of the file was loaded
+int editorWaitKey(int timeout) {
+    int c = editorInputByte(timeout);
+    if (c == -1) return NO_KEY;
+
+    if (c == '\x1b') {
+        int seq[3];
+        if ((seq[0] = editorInputByte(ESC_WAIT_MS)) == -1) return '\x1b';
+        if ((seq[1] = editorInputByte(ESC_WAIT_MS)) == -1) return '\x1b';
+
+        if (seq[0] == '[') {
+            if (seq[1] >= '0' && seq[1] <= '9') {
+                // ESC[<number>~, the number being one digit or 200 for a paste
+                int num = seq[1] - '0';
+                while ((seq[2] = editorInputByte(ESC_WAIT_MS)) >= '0' && seq[2] <= '9' && num < 1000)
+                    num = num * 10 + seq[2] - '0';
+                if (seq[2] == '~') {
+                    switch (num) {
+                        case 3: return DEL;
+                        case 5: return P_UP;
+                        case 6: return P_DOWN;
+                        case 200:
+                            editorReadPaste();
+                            return PASTE;
+                    }
+                }
+            } else {
+                switch (seq[1]) {
+                    case 'A': return UP;
+                    case 'B': return DOWN;
+                    case 'C': return RIGHT;
+                    case 'D': return LEFT;
+                }
             }
         }
+    
 
-        prev_sep = is_separator(c);
-        i++;
+    return '\x1b';
+    } else {
+        return c;
     }
+}
 
-    int changed = (row->hl_open_comment != in_comment);
-    row->hl_open_comment = in_comment;
-    if (changed && row->idx + 1 < E.numrows)
-        editorUpdateSyntax(&E.row[row->idx + 1]); 
+/// @brief Read one keypress, giving up after a prompt tick
+/// @return Pressed key, or NO_KEY if none arrived
+int editorPollKey() {
+    return editorWaitKey(PROMPT_TICK_MS);
 }
 
-/* 31 = */
-int editorSyntaxToColor(int hl) {
-    switch (hl) {
-        case HL_MLCOMMENT:
-        case HL_COMMENT: return 35;// MAGENTA
-        case HL_KEYWORD1: return 31; // RED
-        case HL_KEYWORD2: return 34; // BLUE
-        case HL_NUMBER: return 36; // CYAN
-        case HL_STRING: return 32; // GREEN
-        case HL_MATCH: return 33;  // YELLOW
-        default: return 37;        // WHITE
+/// @brief Wait for one keypress & return it. The screen is redrawn whenever
+/// the wait is cut short by a resize, by more of the file loading or by the
+/// status message expiring.
+/// @return Pressed key
+int editorReadKey() {
+    int c;
+    for (;;) {
+        int timeout = -1;
+        if (E.statusmsg[0] && E.statusmsg_time) {
+            time_t left = E.statusmsg_time + 5 - time(NULL);
+            timeout = left >= 0 ? (int)(left + 1) * 1000 : -1;
+        }
+
+        // Line storage is compacted in steps while no keys come
+        int compact = E.search == NULL && lineCompactDue();
+        if (compact) {
+            int idle = lineCompactRunning() ? 0 : LINE_COMPACT_IDLE_MS;
+            if (timeout == -1 || timeout > idle) timeout = idle;
+        }
+
+        if ((c = editorWaitKey(timeout)) != NO_KEY) return c;
+        if (compact) lineCompactStep();
+        editorRefreshScreen();
     }
 }
 
-void editorSelectSyntaxHighlight() {
-    E.syntax = NULL;
-    if(E.filename == NULL) return;
+/*** profiling ***/
+
+/*
+ * The hot paths are timed as spans. When FLIT_TRACE names a file, every span
+ * is written there in Chrome's trace event format, for chrome://tracing or
+ * Perfetto; otherwise a span costs a single check. Spans come from worker
+ * threads too, so they are buffered under a lock & written a batch at a time.
+ * Frame times are always kept, for the HUD Ctrl-P shows in the message bar.
+ */
+
+#define PROF_EVENTS 4096    // Spans buffered before they are written out
+#define PROF_THREADS 64     // Threads told apart in a trace
+#define PROF_FRAMES 256     // Recent frames the HUD's percentile is over
+
+typedef struct profEvent {
+    const char* cat;
+    const char* name;
+    long long start;        // ns since the editor started
+    long long dur;
+    int tid;
+} profEvent;
+
+struct profiler {
+    FILE* trace;            // Trace being written, NULL if not tracing
+    pthread_mutex_t lock;   // Guards the events, threads & trace
+    profEvent* events;
+    int nevents;
+    int written;            // Events written to the trace so far
+    pthread_t threads[PROF_THREADS]; // A thread's trace id is its index + 1
+    const char* thread_cats[PROF_THREADS];
+    int nthreads;
+    long long epoch;
+
+    // Main thread only
+    long long key_at;       // When the first key since the last frame was read, 0 if none
+    long long frames[PROF_FRAMES]; // ns from a key, or the refresh, to its frame being written
+    long long nframes;      // Frames timed, the last PROF_FRAMES of them kept
+    int hud;                // Show frame times & memory in the message bar
+};
 
-    char* ext = strrchr(E.filename, '.');
+struct profiler prof = {.lock = PTHREAD_MUTEX_INITIALIZER};
 
-    for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-        struct editorSyntax* s = &HLDB[j];
-        unsigned int i = 0;
-        while(s->filematch[i]) {
-            int is_ext = (s->filematch[i][0] == '.');
-            if((is_ext && ext && !strcmp(ext, s->filematch[i])) || (!is_ext && strstr(E.filename, s->filematch[i]))) {
-                E.syntax = s;
+/// @brief Monotonic time in ns
+long long profNow() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
 
-                int filerow;
-                for (filerow = 0; filerow < E.numrows; filerow++) {
-                    editorUpdateSyntax(&E.row[filerow]);
-                }
+/// @brief Start timing a span
+/// @return its start, or 0 if not tracing
+long long profBegin() {
+    return prof.trace ? profNow() : 0;
+}
 
-                return;
-            }
-            i++;
-        }
+/// @brief Write the buffered events to the trace. Caller holds the lock.
+void profFlush() {
+    for (int k = 0; k < prof.nevents; k++) {
+        profEvent* e = &prof.events[k];
+        fprintf(prof.trace, "%s\n{\"cat\":\"%s\",\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+            prof.written++ ? "," : "", e->cat, e->name, e->tid,
+            (e->start - prof.epoch) / 1e3, e->dur / 1e3);
     }
+    prof.nevents = 0;
 }
 
-/*** row operations ***/
-
-/// @brief Convert cx to rx
-/// @param row row to convert
-int editorRowCxToRx(erow *row, int cx) {
-    int rx = 0;
-    int j;
-    for (j = 0; j < cx; j++) {
-        if (row->chars[j] == '\t')
-            rx += (TAB_STOP - 1) - (rx % TAB_STOP);
-        rx++;
+/// @brief Trace id of the calling thread, named after the category of its
+/// spans. A finished worker's pthread_t is reused by later ones, so workers
+/// are told apart by category too. Caller holds the lock.
+int profThread(const char* cat) {
+    pthread_t self = pthread_self();
+    for (int k = 0; k < prof.nthreads; k++) {
+        if (pthread_equal(prof.threads[k], self) && (k == 0 || !strcmp(prof.thread_cats[k], cat)))
+            return k + 1; // The main thread, first in, has spans of every category
     }
-    return rx;
+    if (prof.nthreads == PROF_THREADS) return PROF_THREADS + 1; // Lumped together
+
+    prof.thread_cats[prof.nthreads] = cat;
+    prof.threads[prof.nthreads++] = self;
+    fprintf(prof.trace, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+        prof.written++ ? "," : "", prof.nthreads, cat);
+    return prof.nthreads;
 }
 
-int editorRowRxToCx(erow* row, int rx) {
-    int cur_rx = 0;
-    int cx;
-    for (cx = 0; cx < row->size; cx++) {
-        if (row->chars[cx] == '\t')
-            cur_rx += (TAB_STOP - 1) - (cur_rx % TAB_STOP);
-        cur_rx++;
+/// @brief End a span begun with profBegin, recording it if tracing
+void profEnd(const char* cat, const char* name, long long start) {
+    if (start == 0) return;
+    long long end = profNow();
 
-        if (cur_rx > rx) return cx;
+    pthread_mutex_lock(&prof.lock);
+    if (prof.trace) {
+        if (prof.nevents == PROF_EVENTS) profFlush();
+        prof.events[prof.nevents++] = (profEvent){cat, name, start, end - start, profThread(cat)};
     }
-    return cx;
+    pthread_mutex_unlock(&prof.lock);
 }
 
-void editorUpdateRow(erow *row) {
-    int tabs = 0;
-    int j;
-    for(j = 0; j < row->size; j++) {
-        if(row->chars[j] == '\t') tabs++;
-    }
-    
-    free(row->render);
-    row->render = malloc(row->size + tabs*(TAB_STOP-1) + 1);
-    
-    int idx = 0;
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            row->render[idx++] = ' ';
-            while (idx % TAB_STOP != 0) row -> render[idx++] = ' ';
-        } else {
-            row->render[idx++] = row->chars[j];
-        }
+/// @brief Finish & close the trace
+void profClose() {
+    pthread_mutex_lock(&prof.lock);
+    if (prof.trace) {
+        profFlush();
+        fputs("\n]}\n", prof.trace);
+        fclose(prof.trace);
+        prof.trace = NULL;
+        free(prof.events);
+        prof.events = NULL;
     }
-    row->render[idx] = '\0';
-    row->rsize = idx;
-
-    editorUpdateSyntax(row);
+    pthread_mutex_unlock(&prof.lock);
 }
 
-void editorInsertRow(int at, char* s, size_t len) {
-    if(at < 0 || at > E.numrows) return;
+/// @brief Start a trace if FLIT_TRACE names a file to write it to
+void profOpen() {
+    prof.epoch = profNow();
 
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-    for (int j = at + 1; j <= E.numrows; j++) E.row[j].idx++;
-    
-    E.row[at].idx = at;
+    char* path = getenv("FLIT_TRACE");
+    if (path == NULL || path[0] == '\0' || prof.trace) return;
 
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len+1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+    prof.trace = fopen(path, "w");
+    if (prof.trace == NULL) fail("fopen");
+    prof.events = malloc(sizeof(profEvent) * PROF_EVENTS);
+    if (prof.events == NULL) fail("malloc");
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    E.row[at].hl = NULL;
-    E.row[at].hl_open_comment = 0;
-    editorUpdateRow(&E.row[at]);
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", prof.trace);
+    pthread_mutex_lock(&prof.lock);
+    profThread("main");
+    pthread_mutex_unlock(&prof.lock);
+    atexit(profClose);
+}
 
-    E.numrows++;
-    E.dirty++;
+/// @brief Note a key being read, which the next frame is timed from
+void profKey() {
+    if (prof.key_at == 0) prof.key_at = profNow();
 }
 
-void editorFreeRow(erow* row) {
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
+/// @brief Record the time to a frame that was refreshed from start
+void profFrame(long long start) {
+    long long from = prof.key_at ? prof.key_at : start;
+    prof.frames[prof.nframes++ % PROF_FRAMES] = profNow() - from;
+    prof.key_at = 0;
 }
 
-void editorDelRow(int at) {
-    if (at < 0 || at >= E.numrows) return;
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-    for (int j = at; j < E.numrows - 1; j++) E.row[j].idx--;
-    E.numrows--;
-    E.dirty++;
+int profCmpTime(const void* a, const void* b) {
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return (x > y) - (x < y);
 }
 
-void editorRowInsertChar(erow* row, int at, int c) {
-    if (at < 0 || at > row->size) {
-        at = row->size; // Interesting wraparound
+/// @brief Time of the last frame & the 99th percentile of recent ones, in ns
+void profFrameTimes(long long* last, long long* p99) {
+    int n = prof.nframes < PROF_FRAMES ? prof.nframes : PROF_FRAMES;
+    if (n == 0) {
+        *last = *p99 = 0;
+        return;
     }
 
-    row->chars = realloc(row->chars, row->size+2);
-    memmove(&row->chars[at+1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-    editorUpdateRow(row);
-    E.dirty++;
+    long long sorted[PROF_FRAMES];
+    memcpy(sorted, prof.frames, sizeof(long long) * n);
+    qsort(sorted, n, sizeof(long long), profCmpTime);
+    *last = prof.frames[(prof.nframes - 1) % PROF_FRAMES];
+    *p99 = sorted[(n * 99 + 99) / 100 - 1];
 }
 
-void editorRowInsertString(erow* row, int at, int len, char* cs) {
-    if (at < 0 || at > row->size) {
-        at = row->size;
-    }
-
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memmove(&row->chars[at+len], &row->chars[at], row->size - at + 1);
-    memcpy(&row->chars[at], cs, len);
-    row->size += len;
-    editorUpdateRow(row);
-    E.dirty++;
+/*** row storage ***/
+
+/*
+ * Rows live in fixed-size blocks which are kept in a treap ordered by
+ * position. Every node caches the number of rows in its subtree, so finding,
+ * inserting or removing a row costs O(log n) rather than shifting one large
+ * array. A row's index is never stored; it is recovered by walking from its
+ * block up to the root.
+ */
+
+#define ROWS_PER_BLOCK 64
+
+typedef struct rowblock {
+    struct rowblock* left;
+    struct rowblock* right;
+    struct rowblock* parent;
+    int priority;           // Treap heap key
+    int numrows;            // Rows held in this block
+    ssize_t subrows;        // Rows held in this block & its subtrees
+    erow rows[ROWS_PER_BLOCK];
+} rowblock;
+
+ssize_t rowblockSize(rowblock* b) {
+    return b ? b->subrows : 0;
 }
 
-void editorRowAppendString(erow* row, char* s, size_t len) {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    E.dirty++;
+/// @brief Recompute a block's subtree count & adopt its children
+void rowblockPull(rowblock* b) {
+    b->subrows = b->numrows + rowblockSize(b->left) + rowblockSize(b->right);
+    if (b->left) b->left->parent = b;
+    if (b->right) b->right->parent = b;
 }
 
-void editorRowDeleteChar(erow* row, int at) {
-    if (at < 0 || at >= row->size) return;
+rowblock* rowblockNew() {
+    rowblock* b = malloc(sizeof(rowblock));
+    if (b == NULL) fail("malloc");
+    b->left = b->right = b->parent = NULL;
+    b->priority = rand();
+    b->numrows = 0;
+    b->subrows = 0;
+    return b;
+}
 
-    memmove(&row->chars[at], &row->chars[at+1], row->size - at);
-    row->size--;
-    editorUpdateRow(row);
-    E.dirty++;
+/// @brief Point the rows in [from, to) of a block back at the block
+void rowblockAdopt(rowblock* b, int from, int to) {
+    for (int j = from; j < to; j++) b->rows[j].block = b;
 }
 
-/*** editor operations ***/
+/// @brief Join two trees, every row of a preceding every row of b
+rowblock* rowblockMerge(rowblock* a, rowblock* b) {
+    if (!a) return b;
+    if (!b) return a;
 
-void editorInsertChar(int c) {
-    if(E.cy == E.numrows) {
-        editorInsertRow(E.numrows, "", 0);
+    if (a->priority > b->priority) {
+        a->right = rowblockMerge(a->right, b);
+        rowblockPull(a);
+        return a;
+    } else {
+        b->left = rowblockMerge(a, b->left);
+        rowblockPull(b);
+        return b;
     }
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
-    E.cx++;
 }
 
-void editorInsertNewline() {
+/// @brief Split a tree so that *l holds its first k rows and *r the rest.
+/// A block straddling the split point is cut in two.
+void rowblockSplit(rowblock* t, ssize_t k, rowblock** l, rowblock** r) {
+    if (!t) {
+        *l = *r = NULL;
+        return;
+    }
+
+    ssize_t lsize = rowblockSize(t->left);
+    if (k <= lsize) {
+        rowblockSplit(t->left, k, l, &t->left);
+        rowblockPull(t);
+        *r = t;
+    } else if (k >= lsize + t->numrows) {
+        rowblockSplit(t->right, k - lsize - t->numrows, &t->right, r);
+        rowblockPull(t);
+        *l = t;
+    } else {
+        int cut = k - lsize;
+        rowblock* tail = rowblockNew();
+        tail->numrows = t->numrows - cut;
+        memcpy(tail->rows, &t->rows[cut], sizeof(erow) * tail->numrows);
+        rowblockAdopt(tail, 0, tail->numrows);
+        rowblockPull(tail);
+        t->numrows = cut;
+
+        rowblock* right = t->right;
+        t->right = NULL;
+        rowblockPull(t);
+        *l = t;
+        *r = rowblockMerge(tail, right);
+    }
+}
+
+/// @brief Recount every block from b up to the root
+void rowblockPullPath(rowblock* b) {
+    for (; b; b = b->parent) rowblockPull(b);
+}
+
+/// @brief Find the block holding row `at` without touching the lookup cache,
+/// so it is safe to use off the main thread while rows aren't being added or removed
+/// @return the block, with the index of its first row in start, or NULL if no block holds the row
+rowblock* rowblockFind(rowblock* b, ssize_t at, ssize_t* start) {
+    ssize_t base = 0;
+    while (b) {
+        ssize_t lsize = rowblockSize(b->left);
+        if (at < base + lsize) {
+            b = b->left;
+        } else if (at < base + lsize + b->numrows) {
+            *start = base + lsize;
+            return b;
+        } else {
+            base += lsize + b->numrows;
+            b = b->right;
+        }
+    }
+    *start = base;
+    return NULL;
+}
+
+void editorSetRowRoot(rowblock* root) {
+    if (root) root->parent = NULL;
+    E.rows = root;
+    E.numrows = rowblockSize(root);
+    E.row_cache = NULL;
+}
+
+/// @brief Find the block holding row `at`
+/// @param start receives the index of the block's first row
+rowblock* editorFindBlock(ssize_t at, ssize_t* start) {
+    if (E.row_cache && at >= E.row_cache_start && at < E.row_cache_start + E.row_cache->numrows) {
+        *start = E.row_cache_start;
+        return E.row_cache;
+    }
+
+    rowblock* b = rowblockFind(E.rows, at, start);
+    if (b) {
+        E.row_cache = b;
+        E.row_cache_start = *start;
+    }
+    return b;
+}
+
+/// @brief Row at index `at`. Pointers are invalidated by row insertion & deletion.
+erow* editorRowAt(ssize_t at) {
+    if (at < 0 || at >= E.numrows) return NULL;
+    ssize_t start;
+    rowblock* b = editorFindBlock(at, &start);
+    return &b->rows[at - start];
+}
+
+/// @brief Recover the index of a row from its position in the tree
+ssize_t editorRowIndex(erow* row) {
+    rowblock* b = row->block;
+    ssize_t idx = rowblockSize(b->left) + (row - b->rows);
+    for (; b->parent; b = b->parent) {
+        if (b == b->parent->right)
+            idx += rowblockSize(b->parent->left) + b->parent->numrows;
+    }
+    return idx;
+}
+
+/// @brief Put a block in place of the tree node `b` is currently occupying
+void rowblockReplace(rowblock* b, rowblock* with) {
+    rowblock* p = b->parent;
+    if (with) with->parent = p;
+    if (!p) {
+        editorSetRowRoot(with);
+    } else {
+        if (p->left == b) p->left = with;
+        else p->right = with;
+        rowblockPull(p);
+        rowblockPullPath(p->parent);
+        E.numrows = rowblockSize(E.rows);
+    }
+}
+
+/// @brief In-order successor of a block
+rowblock* rowblockNext(rowblock* b) {
+    if (b->right) {
+        b = b->right;
+        while (b->left) b = b->left;
+        return b;
+    }
+    while (b->parent && b == b->parent->right) b = b->parent;
+    return b->parent;
+}
+
+/// @brief Make room for one uninitialised row at index `at` and return it
+erow* editorRowStoreInsert(ssize_t at) {
+    E.row_cache = NULL;
+
+    if (E.rows == NULL) {
+        rowblock* b = rowblockNew();
+        b->numrows = 1;
+        rowblockAdopt(b, 0, 1);
+        rowblockPull(b);
+        editorSetRowRoot(b);
+        return &b->rows[0];
+    }
+
+    ssize_t start;
+    rowblock* b = editorFindBlock(at == E.numrows ? at - 1 : at, &start);
+    E.row_cache = NULL;
+
+    if (b->numrows == ROWS_PER_BLOCK) {
+        // Split the full block in half, the new half following it in the tree
+        rowblock* tail = rowblockNew();
+        tail->numrows = b->numrows / 2;
+        b->numrows -= tail->numrows;
+        memcpy(tail->rows, &b->rows[b->numrows], sizeof(erow) * tail->numrows);
+        rowblockAdopt(tail, 0, tail->numrows);
+        rowblockPull(tail);
+        rowblockPullPath(b);
+
+        rowblock *l, *r;
+        rowblockSplit(E.rows, start + b->numrows, &l, &r);
+        editorSetRowRoot(rowblockMerge(rowblockMerge(l, tail), r));
+        if (at - start > b->numrows) {
+            start += b->numrows;
+            b = tail;
+        }
+    }
+
+    int pos = at - start;
+    memmove(&b->rows[pos + 1], &b->rows[pos], sizeof(erow) * (b->numrows - pos));
+    b->numrows++;
+    b->rows[pos].block = b;
+    rowblockPullPath(b);
+    E.numrows++;
+    return &b->rows[pos];
+}
+
+/// @brief Make room for n uninitialised rows starting at index `at`. The new
+/// rows are packed into fresh blocks & spliced in with one split & merge.
+void editorRowStoreInsertMany(ssize_t at, ssize_t n) {
+    rowblock* added = NULL;
+    while (n > 0) {
+        rowblock* b = rowblockNew();
+        b->numrows = n < ROWS_PER_BLOCK ? n : ROWS_PER_BLOCK;
+        rowblockAdopt(b, 0, b->numrows);
+        rowblockPull(b);
+        added = rowblockMerge(added, b);
+        n -= b->numrows;
+    }
+
+    rowblock *l, *r;
+    E.row_cache = NULL;
+    rowblockSplit(E.rows, at, &l, &r);
+    editorSetRowRoot(rowblockMerge(rowblockMerge(l, added), r));
+}
+
+/// @brief Remove the row at index `at` from the tree. The row must already be freed.
+void editorRowStoreDelete(ssize_t at) {
+    ssize_t start;
+    rowblock* b = editorFindBlock(at, &start);
+    E.row_cache = NULL;
+
+    int pos = at - start;
+    memmove(&b->rows[pos], &b->rows[pos + 1], sizeof(erow) * (b->numrows - pos - 1));
+    b->numrows--;
+    rowblockPullPath(b);
+    E.numrows--;
+
+    if (b->numrows == 0) {
+        rowblockReplace(b, rowblockMerge(b->left, b->right));
+        free(b);
+        return;
+    }
+
+    // Fold a sparse neighbour in so blocks don't fragment into single rows
+    rowblock* next = rowblockNext(b);
+    if (next && b->numrows + next->numrows <= ROWS_PER_BLOCK / 2) {
+        memcpy(&b->rows[b->numrows], next->rows, sizeof(erow) * next->numrows);
+        rowblockAdopt(b, b->numrows, b->numrows + next->numrows);
+        b->numrows += next->numrows;
+        next->numrows = 0;
+        rowblockPullPath(b);
+        rowblockPullPath(next);
+        rowblockReplace(next, rowblockMerge(next->left, next->right));
+        free(next);
+    }
+}
+
+void rowblockFreeTree(rowblock* b) {
+    if (b == NULL) return;
+    rowblockFreeTree(b->left);
+    rowblockFreeTree(b->right);
+    free(b);
+}
+
+/// @brief Remove the n rows starting at index `at` with one split & merge.
+/// The rows must already be freed.
+void editorRowStoreDeleteMany(ssize_t at, ssize_t n) {
+    rowblock *l, *mid, *r;
+    E.row_cache = NULL;
+    rowblockSplit(E.rows, at, &l, &r);
+    rowblockSplit(r, n, &mid, &r);
+    rowblockFreeTree(mid);
+    editorSetRowRoot(rowblockMerge(l, r));
+}
+
+/// @brief Bytes of aux a row with these tabs, render & runs needs up to its runs
+size_t editorRowSpansOffset(ssize_t ntabs, ssize_t rsize) {
+    if (ntabs == 0) return 0;
+    size_t render = rsize + 1;
+    render = (render + sizeof(hlSpan) - 1) / sizeof(hlSpan) * sizeof(hlSpan);
+    return sizeof(rowTab) * ntabs + render;
+}
+
+rowTab* editorRowTabs(erow* row) {
+    return (rowTab*)row->aux;
+}
+
+/// @brief A row's render. Only valid once it has been brought up to date.
+char* editorRowRender(erow* row) {
+    return row->ntabs ? (char*)row->aux + sizeof(rowTab) * row->ntabs : row->chars;
+}
+
+hlSpan* editorRowSpans(erow* row) {
+    return (hlSpan*)((char*)row->aux + editorRowSpansOffset(row->ntabs, row->rsize));
+}
+
+ssize_t row_aux_bytes = 0; // Bytes every row's aux adds up to
+
+/// @brief Bytes a row's aux holds
+size_t editorRowAuxBytes(erow* row) {
+    if (row->aux == NULL) return 0;
+    return editorRowSpansOffset(row->ntabs, row->rsize) + sizeof(hlSpan) * row->nspans;
+}
+
+/// @brief Heap bytes a row holds, the erow itself included
+size_t editorRowBytes(erow* row) {
+    size_t bytes = sizeof(erow);
+    if (!row->mapped) bytes += row->size + 1;
+    return bytes + editorRowAuxBytes(row);
+}
+
+/*** line storage ***/
+
+/*
+ * Row text lives in slabs of fixed-size slots, one size class per power of
+ * two from 16 bytes to 4 KiB. A line gets the smallest slot it fits in, so
+ * it can grow in place until that slot is full, & freeing it only pushes the
+ * slot back onto its slab's free list. The byte before a line names its
+ * class, so a line is freed or resized from its pointer alone. Longer lines
+ * are malloc'd on their own with a quarter again as much room as asked for.
+ *
+ * Slabs are aligned to their size, so a slot's slab is found by masking its
+ * address. Heavy editing can leave many slabs sparsely used; when the editor
+ * is idle the sparsest are emptied by moving their lines into the others, a
+ * few thousand rows at a time.
+ */
+
+#define LINE_SLAB_SIZE (64 * 1024)
+#define LINE_MIN_SLOT 16
+#define LINE_CLASSES 9              // Slots of 16 << k bytes
+#define LINE_LARGE LINE_CLASSES     // Class of a line malloc'd on its own
+#define LINE_LARGE_HEAD 16          // Capacity, padding & class before a large line
+#define LINE_COMPACT_ROWS 4096      // Rows a compaction step visits
+
+typedef struct lineSlab {
+    struct lineSlab* next;
+    struct lineSlab* prev;
+    char* free;             // First free slot, each holding the next
+    int used;               // Slots holding lines
+    int cls;
+    int evacuating;         // Being emptied by compaction, so takes no new lines
+} lineSlab;
+
+struct lineClass {
+    lineSlab* avail;        // Slabs with free slots that take new lines
+    lineSlab* rest;         // Full slabs & those being emptied
+    ssize_t slabs;
+    ssize_t used;           // Slots holding lines
+};
+
+struct lineStore {
+    struct lineClass classes[LINE_CLASSES];
+    ssize_t large;          // Lines malloc'd on their own
+    ssize_t large_bytes;
+    ssize_t compact_at;     // Next row the running compaction pass visits, -1 if none
+    int settled;            // Nothing was freed since the last pass finished
+    ssize_t moved;          // Lines moved by compaction
+};
+
+struct lineStore line_store = {.compact_at = -1};
+
+ssize_t lineSlotSize(int cls) {
+    return (ssize_t)LINE_MIN_SLOT << cls;
+}
+
+/// @brief Offset of a slab's first slot, past its header
+ssize_t lineSlabFirst(int cls) {
+    ssize_t slot = lineSlotSize(cls);
+    return ((ssize_t)sizeof(lineSlab) + slot - 1) / slot * slot;
+}
+
+ssize_t lineSlabSlots(int cls) {
+    return (LINE_SLAB_SIZE - lineSlabFirst(cls)) / lineSlotSize(cls);
+}
+
+/// @brief Smallest class whose slots hold len bytes, or LINE_LARGE
+int lineClassFor(ssize_t len) {
+    for (int cls = 0; cls < LINE_CLASSES; cls++) {
+        if (len < lineSlotSize(cls)) return cls;
+    }
+    return LINE_LARGE;
+}
+
+void lineSlabUnlink(lineSlab** list, lineSlab* slab) {
+    if (slab->prev) slab->prev->next = slab->next;
+    else *list = slab->next;
+    if (slab->next) slab->next->prev = slab->prev;
+}
+
+void lineSlabPush(lineSlab** list, lineSlab* slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list) (*list)->prev = slab;
+    *list = slab;
+}
+
+lineSlab* lineSlabNew(int cls) {
+    void* mem;
+    if (posix_memalign(&mem, LINE_SLAB_SIZE, LINE_SLAB_SIZE) != 0) fail("posix_memalign");
+
+    lineSlab* slab = mem;
+    slab->free = NULL;
+    slab->used = 0;
+    slab->cls = cls;
+    slab->evacuating = 0;
+
+    ssize_t slot = lineSlotSize(cls);
+    for (ssize_t off = LINE_SLAB_SIZE - slot; off >= lineSlabFirst(cls); off -= slot) {
+        char* p = (char*)mem + off;
+        *(char**)p = slab->free;
+        slab->free = p;
+    }
+
+    line_store.classes[cls].slabs++;
+    return slab;
+}
+
+/// @brief Storage for a line of len bytes, its '\0' included
+char* lineAlloc(ssize_t len) {
+    int cls = lineClassFor(len);
+
+    if (cls == LINE_LARGE) {
+        size_t cap = len + len / 4;
+        char* p = malloc(LINE_LARGE_HEAD + cap);
+        if (p == NULL) fail("malloc");
+        *(size_t*)p = cap;
+        p[LINE_LARGE_HEAD - 1] = LINE_LARGE;
+        line_store.large++;
+        line_store.large_bytes += cap;
+        return p + LINE_LARGE_HEAD;
+    }
+
+    struct lineClass* c = &line_store.classes[cls];
+    if (c->avail == NULL) lineSlabPush(&c->avail, lineSlabNew(cls));
+
+    lineSlab* slab = c->avail;
+    char* slot = slab->free;
+    slab->free = *(char**)slot;
+    slab->used++;
+    c->used++;
+    if (slab->free == NULL) {
+        lineSlabUnlink(&c->avail, slab);
+        lineSlabPush(&c->rest, slab);
+    }
+
+    slot[0] = cls;
+    return slot + 1;
+}
+
+/// @brief Bytes the line at p has room for, its '\0' included
+ssize_t lineCapacity(char* p) {
+    int cls = p[-1];
+    if (cls == LINE_LARGE) return *(size_t*)(p - LINE_LARGE_HEAD);
+    return lineSlotSize(cls) - 1;
+}
+
+void lineFree(char* p) {
+    if (p == NULL) return;
+
+    int cls = p[-1];
+    if (cls == LINE_LARGE) {
+        line_store.large--;
+        line_store.large_bytes -= *(size_t*)(p - LINE_LARGE_HEAD);
+        free(p - LINE_LARGE_HEAD);
+        return;
+    }
+
+    line_store.settled = 0;
+    char* slot = p - 1;
+    lineSlab* slab = (lineSlab*)((uintptr_t)slot & ~(uintptr_t)(LINE_SLAB_SIZE - 1));
+    struct lineClass* c = &line_store.classes[cls];
+    int was_full = (slab->free == NULL);
+
+    *(char**)slot = slab->free;
+    slab->free = slot;
+    slab->used--;
+    c->used--;
+
+    if (slab->used == 0 && (slab->evacuating || c->avail != slab || slab->next)) {
+        // Empty: give it back, unless it is the only slab taking new lines
+        lineSlabUnlink((slab->evacuating || was_full) ? &c->rest : &c->avail, slab);
+        c->slabs--;
+        free(slab);
+    } else if (was_full && !slab->evacuating) {
+        lineSlabUnlink(&c->rest, slab);
+        lineSlabPush(&c->avail, slab);
+    }
+}
+
+/// @brief Room for len bytes in the line at p, moving it if it has outgrown its slot
+/// @return the line, wherever it now is
+char* lineResize(char* p, ssize_t len) {
+    if (p == NULL) return lineAlloc(len);
+    ssize_t cap = lineCapacity(p);
+    if (len <= cap) return p;
+
+    if (p[-1] == LINE_LARGE && lineClassFor(len) == LINE_LARGE) {
+        size_t grown = len + len / 4;
+        char* q = realloc(p - LINE_LARGE_HEAD, LINE_LARGE_HEAD + grown);
+        if (q == NULL) fail("realloc");
+        *(size_t*)q = grown;
+        line_store.large_bytes += grown - cap;
+        return q + LINE_LARGE_HEAD;
+    }
+
+    char* q = lineAlloc(len);
+    memcpy(q, p, cap);
+    lineFree(p);
+    return q;
+}
+
+/// @brief Whether a class has at least a slab's worth of free slots & under
+/// three quarters of its slots in use
+int lineClassFragmented(int cls) {
+    struct lineClass* c = &line_store.classes[cls];
+    ssize_t slots = c->slabs * lineSlabSlots(cls);
+    return slots - c->used >= lineSlabSlots(cls) && c->used * 4 < slots * 3;
+}
+
+int lineCompactRunning() {
+    return line_store.compact_at != -1;
+}
+
+/// @brief Whether a compaction pass is running, or one would find slabs to empty
+int lineCompactDue() {
+    if (lineCompactRunning()) return 1;
+    if (line_store.settled) return 0;
+    for (int cls = 0; cls < LINE_CLASSES; cls++) {
+        if (lineClassFragmented(cls)) return 1;
+    }
+    return 0;
+}
+
+int lineSlabCmpUsed(const void* a, const void* b) {
+    return (*(lineSlab* const*)a)->used - (*(lineSlab* const*)b)->used;
+}
+
+/// @brief Begin a compaction pass: in each fragmented class, mark the
+/// sparsest slabs for emptying, as many as the other slabs have room for
+void lineCompactStart() {
+    for (int cls = 0; cls < LINE_CLASSES; cls++) {
+        if (!lineClassFragmented(cls)) continue;
+        struct lineClass* c = &line_store.classes[cls];
+
+        lineSlab** slabs = malloc(sizeof(lineSlab*) * c->slabs);
+        if (slabs == NULL) fail("malloc");
+        ssize_t n = 0;
+        for (lineSlab* slab = c->avail; slab; slab = slab->next) slabs[n++] = slab;
+        for (lineSlab* slab = c->rest; slab; slab = slab->next) slabs[n++] = slab;
+        qsort(slabs, n, sizeof(lineSlab*), lineSlabCmpUsed);
+
+        ssize_t room = n * lineSlabSlots(cls) - c->used; // Free slots in the slabs kept
+        ssize_t moving = 0;                                 // Lines in the slabs emptied
+        for (ssize_t j = 0; j < n; j++) {
+            lineSlab* slab = slabs[j];
+            ssize_t freed = lineSlabSlots(cls) - slab->used;
+            if (room - freed < moving + slab->used) break;
+            room -= freed;
+            moving += slab->used;
+
+            lineSlabUnlink(slab->free ? &c->avail : &c->rest, slab);
+            lineSlabPush(&c->rest, slab);
+            slab->evacuating = 1;
+        }
+        free(slabs);
+    }
+    line_store.compact_at = 0;
+}
+
+/// @brief End a compaction pass. Slabs that couldn't be emptied, as their
+/// lines are held by the copy buffer, take new lines again.
+void lineCompactFinish() {
+    for (int cls = 0; cls < LINE_CLASSES; cls++) {
+        struct lineClass* c = &line_store.classes[cls];
+        lineSlab* slab = c->rest;
+        while (slab) {
+            lineSlab* next = slab->next;
+            if (slab->evacuating) {
+                slab->evacuating = 0;
+                if (slab->free) {
+                    lineSlabUnlink(&c->rest, slab);
+                    lineSlabPush(&c->avail, slab);
+                }
+            }
+            slab = next;
+        }
+    }
+    line_store.compact_at = -1;
+    line_store.settled = 1;
+}
+
+/// @brief Run the next step of compaction, starting a pass if one is due.
+/// Lines in slabs being emptied, & lines two or more classes bigger than
+/// they need, are moved into fitting slots.
+void lineCompactStep() {
+    long long span = profBegin();
+    if (line_store.compact_at == -1) lineCompactStart();
+
+    ssize_t end = line_store.compact_at + LINE_COMPACT_ROWS;
+    if (end > E.numrows) end = E.numrows;
+
+    for (ssize_t j = line_store.compact_at; j < end; j++) {
+        erow* row = editorRowAt(j);
+        if (row->mapped || editorRowShared(row)) continue;
+
+        int cls = row->chars[-1];
+        if (cls == LINE_LARGE) continue;
+        lineSlab* slab = (lineSlab*)((uintptr_t)(row->chars - 1) & ~(uintptr_t)(LINE_SLAB_SIZE - 1));
+        if (!slab->evacuating && cls < lineClassFor(row->size + 1) + 2) continue;
+
+        char* chars = lineAlloc(row->size + 1);
+        memcpy(chars, row->chars, row->size + 1);
+        lineFree(row->chars);
+        row->chars = chars;
+        line_store.moved++;
+    }
+
+    line_store.compact_at = end;
+    if (end == E.numrows) lineCompactFinish();
+    profEnd("rows", "compact", span);
+}
+
+/// @brief Describe the line storage in a status message
+void lineStoreReport() {
+    ssize_t slabs = 0, slots = 0, used = 0;
+    for (int cls = 0; cls < LINE_CLASSES; cls++) {
+        struct lineClass* c = &line_store.classes[cls];
+        slabs += c->slabs;
+        slots += c->slabs * lineSlabSlots(cls);
+        used += c->used;
+    }
+
+    editorSetStatusMessage("Lines: %zd in %zd slabs, %d%% full, %.1f MiB | %zd long, %.1f MiB | %zd moved",
+        used, slabs, slots ? (int)(used * 100 / slots) : 100, slabs * (double)LINE_SLAB_SIZE / (1 << 20),
+        line_store.large, line_store.large_bytes / (double)(1 << 20), line_store.moved);
+}
+
+/** syntax highlighting ***/
+
+int is_separator(int c) {
+    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+/*
+ * Keyword lists are compiled into a perfect hash the first time their syntax
+ * is selected: lengths & classes are taken from the "|" suffix once, and a
+ * seed is searched for which puts every keyword in its own slot. Looking up
+ * a token is then one hash, one probe & one compare.
+ */
+
+unsigned int keywordHash(const char* s, int len, unsigned int seed) {
+    unsigned int h = 2166136261u ^ seed;
+    for (int j = 0; j < len; j++) {
+        h ^= (unsigned char)s[j];
+        h *= 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+struct keywordTable* editorCompileKeywords(char** keywords) {
+    struct keywordTable* t = malloc(sizeof(struct keywordTable));
+    if (t == NULL) fail("malloc");
+
+    int n = 0;
+    while (keywords[n]) n++;
+
+    unsigned int size = 8;
+    while (size < 2 * (unsigned int)n) size *= 2;
+    t->slots = NULL;
+
+    for (;;) {
+        t->slots = realloc(t->slots, sizeof(struct keyword) * size);
+        if (t->slots == NULL) fail("realloc");
+        t->mask = size - 1;
+
+        for (t->seed = 0; t->seed < 1024; t->seed++) {
+            memset(t->slots, 0, sizeof(struct keyword) * size);
+            t->maxlen = 0;
+
+            int j;
+            for (j = 0; j < n; j++) {
+                int len = strlen(keywords[j]);
+                int kw2 = keywords[j][len - 1] == '|';
+                if (kw2) len--;
+
+                struct keyword* slot = &t->slots[keywordHash(keywords[j], len, t->seed) & t->mask];
+                if (slot->word) {
+                    // The first listing of a keyword wins, as it did when the list was walked
+                    if (slot->len == len && !strncmp(slot->word, keywords[j], len)) continue;
+                    break; // Collision: try another seed
+                }
+                slot->word = keywords[j];
+                slot->len = len;
+                slot->hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+                if (len > t->maxlen) t->maxlen = len;
+            }
+            if (j == n) return t;
+        }
+        size *= 2;
+    }
+}
+
+/// @brief Find the keyword spelled by s[0..len), if any
+struct keyword* editorKeywordLookup(struct keywordTable* t, const char* s, ssize_t len) {
+    if (len == 0 || len > t->maxlen) return NULL;
+
+    struct keyword* slot = &t->slots[keywordHash(s, len, t->seed) & t->mask];
+    if (slot->word && slot->len == len && !memcmp(slot->word, s, len)) return slot;
+    return NULL;
+}
+
+/// @brief Does highlighting carry state (an open comment) from row to row?
+int editorSyntaxCarriesState() {
+    return E.syntax && E.syntax->multiline_comment_start && E.syntax->multiline_comment_end;
+}
+
+/// @brief Mark the highlighting of row `at` out of date, e.g. when the row above it changed
+void editorInvalidateSyntax(ssize_t at) {
+    erow* row = editorRowAt(at);
+    if (row == NULL) return;
+
+    row->stale |= ROW_STALE_HL | ROW_STALE_STATE;
+    if (at < E.hl_stale_from) E.hl_stale_from = at;
+}
+
+/// @brief Follow only the comment & string rules of editorUpdateSyntax over a
+/// row's chars, without building render or hl.
+/// @return whether the row leaves a multiline comment open
+int editorSyntaxScanState(erow* row, int in_comment) {
+    char* scs = E.syntax->singleline_comment_start;
+    char* mcs = E.syntax->multiline_comment_start;
+    char* mce = E.syntax->multiline_comment_end;
+
+    int scs_len = scs ? strlen(scs) : 0;
+    int mcs_len = mcs ? strlen(mcs) : 0;
+    int mce_len = mce ? strlen(mce) : 0;
+
+    int in_string = 0;
+
+    ssize_t i = 0;
+    while (i < row->size) {
+        char c = row->chars[i];
+        ssize_t left = row->size - i;
+
+        if (scs_len && !in_string && !in_comment) {
+            if (left >= scs_len && !memcmp(&row->chars[i], scs, scs_len)) break;
+        }
+
+        if (mcs_len && mce_len && !in_string) {
+            if (in_comment) {
+                if (left >= mce_len && !memcmp(&row->chars[i], mce, mce_len)) {
+                    i += mce_len;
+                    in_comment = 0;
+                } else {
+                    i++;
+                }
+                continue;
+            } else if (left >= mcs_len && !memcmp(&row->chars[i], mcs, mcs_len)) {
+                i += mcs_len;
+                in_comment = 1;
+                continue;
+            }
+        }
+
+        if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
+            if (in_string) {
+                if (c == '\\' && i + 1 < row->size) {
+                    i += 2;
+                    continue;
+                }
+                if (c == in_string) in_string = 0;
+                i++;
+                continue;
+            } else if (c == '"' || c == '\'') {
+                in_string = c;
+                i++;
+                continue;
+            }
+        }
+
+        i++;
+    }
+
+    return in_comment;
+}
+
+/*
+ * Catching up over a long run of rows, as when jumping to the end of a file
+ * just opened, is split into a chunk per core. Each chunk is caught up in
+ * parallel as if the rows above it were unchanged: for a file just opened,
+ * as if it began outside a comment. A sequential pass then rescans only the
+ * chunks whose real entry state differs, & only until a row's state agrees
+ * with the parallel scan, as every row after it must then agree too.
+ */
+
+#define SYNTAX_PARALLEL_ROWS (1 << 16) // Shortest catch-up worth splitting across cores
+#define SYNTAX_MAX_THREADS 64
+
+typedef struct syntaxChunk {
+    pthread_t thread;
+    ssize_t from, to;   // Rows [from, to)
+    int in;             // State assumed to enter the chunk
+    int out;            // State the chunk's last row leaves
+    int changed;        // The last row's state changed, so the next row is stale
+} syntaxChunk;
+
+/// @brief Catch up a chunk's rows the way editorSyntaxCatchUp does, from its assumed entry state
+void* syntaxChunkWorker(void* arg) {
+    syntaxChunk* c = arg;
+    int in_comment = c->in, changed = 0;
+    long long span = profBegin();
+
+    ssize_t start = 0, y = c->from;
+    rowblock* b = rowblockFind(E.rows, y, &start);
+    for (; y < c->to; b = rowblockNext(b)) {
+        for (int j = y - start; j < b->numrows && y < c->to; j++, y++) {
+            erow* row = &b->rows[j];
+            if (changed) row->stale |= ROW_STALE_HL | ROW_STALE_STATE;
+            changed = 0;
+            if (row->stale & ROW_STALE_STATE) {
+                int out = editorSyntaxScanState(row, in_comment);
+                row->stale &= ~ROW_STALE_STATE;
+                changed = out != row->hl_open_comment;
+                row->hl_open_comment = out;
+            }
+            in_comment = row->hl_open_comment;
+        }
+        start += b->numrows;
+    }
+
+    c->out = in_comment;
+    c->changed = changed;
+    profEnd("highlight", "catch up chunk", span);
+    return NULL;
+}
+
+/// @brief Bring hl_open_comment up to date for every row above `at` using
+/// every core. Does nothing on a single core.
+void editorSyntaxCatchUpParallel(ssize_t at) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > SYNTAX_MAX_THREADS) n = SYNTAX_MAX_THREADS;
+    if (n < 2) return;
+
+    syntaxChunk chunks[SYNTAX_MAX_THREADS];
+    ssize_t from = E.hl_stale_from, per = (at - from + n - 1) / n;
+    for (long k = 0; k < n; k++) {
+        syntaxChunk* c = &chunks[k];
+        erow* prev = editorRowAt(from + k * per - 1);
+        c->from = from + k * per;
+        c->to = c->from + per < at ? c->from + per : at;
+        c->in = prev && prev->hl_open_comment;
+    }
+    for (long k = 0; k < n; k++) {
+        if (pthread_create(&chunks[k].thread, NULL, syntaxChunkWorker, &chunks[k]) != 0) fail("pthread_create");
+    }
+    for (long k = 0; k < n; k++) pthread_join(chunks[k].thread, NULL);
+
+    // Redo the start of each chunk whose real entry state wasn't the assumed one
+    int in_comment = chunks[0].in;
+    for (long k = 0; k < n; k++) {
+        syntaxChunk* c = &chunks[k];
+        ssize_t y = c->from;
+        for (; in_comment != c->in && y < c->to; y++) {
+            erow* row = editorRowAt(y);
+            row->stale |= ROW_STALE_HL; // Its entry state differs from the one assumed
+            int out = editorSyntaxScanState(row, in_comment);
+            if (out == row->hl_open_comment) break;
+            row->hl_open_comment = out;
+            in_comment = out;
+        }
+        if (y == c->to) c->changed = 1;
+        else in_comment = c->out;
+    }
+
+    E.hl_stale_from = at;
+    if (chunks[n - 1].changed) editorInvalidateSyntax(at);
+}
+
+/*
+ * The lexer works on one hl byte per column, in a scratch buffer shared by
+ * every row. A row only keeps its hl as runs, unpacked into the scratch buffer
+ * when it is patched & packed again afterwards.
+ */
+
+unsigned char* hl_scratch = NULL;
+ssize_t hl_scratch_cap = 0;
+
+/// @brief The scratch hl buffer, with room for at least len columns
+unsigned char* editorHlScratch(ssize_t len) {
+    if (len > hl_scratch_cap) {
+        ssize_t cap = hl_scratch_cap ? hl_scratch_cap : 256;
+        while (cap < len) cap *= 2;
+        hl_scratch = realloc(hl_scratch, cap);
+        if (hl_scratch == NULL) fail("realloc");
+        hl_scratch_cap = cap;
+    }
+    return hl_scratch;
+}
+
+/// @brief Write a row's hl out to hl[0..rsize)
+void editorRowUnpackHl(erow* row, unsigned char* hl) {
+    hlSpan* spans = editorRowSpans(row);
+    ssize_t at = 0;
+    for (ssize_t k = 0; k < row->nspans; k++) {
+        memset(&hl[at], spans[k].hl, spans[k].len);
+        at += spans[k].len;
+    }
+    memset(&hl[at], HL_NORMAL, row->rsize - at);
+}
+
+/// @brief Store hl[0..rsize) as the row's runs
+void editorRowPackHl(erow* row, unsigned char* hl) {
+    ssize_t end = row->rsize;
+    while (end > 0 && hl[end - 1] == HL_NORMAL) end--;
+
+    ssize_t n = 0;
+    for (ssize_t j = 0; j < end; n++) {
+        ssize_t run = j;
+        while (run < end && hl[run] == hl[j] && run - j < HL_SPAN_MAX) run++;
+        j = run;
+    }
+
+    size_t offset = editorRowSpansOffset(row->ntabs, row->rsize);
+    row_aux_bytes -= editorRowAuxBytes(row);
+    if (offset + n == 0) {
+        free(row->aux);
+        row->aux = NULL;
+    } else if (n != row->nspans) {
+        row->aux = realloc(row->aux, offset + sizeof(hlSpan) * n);
+        if (row->aux == NULL) fail("realloc");
+    }
+    row->nspans = n;
+    row_aux_bytes += editorRowAuxBytes(row);
+
+    hlSpan* spans = editorRowSpans(row);
+    ssize_t k = 0;
+    for (ssize_t j = 0; j < end; k++) {
+        ssize_t run = j;
+        while (run < end && hl[run] == hl[j] && run - j < HL_SPAN_MAX) run++;
+        spans[k].len = run - j;
+        spans[k].hl = hl[j];
+        j = run;
+    }
+}
+
+/// @brief Highlight a row's render into hl from position i, the lexer
+/// starting in its plain state there, inside a multiline comment if
+/// in_comment. Past sync_from, if not -1, the old hl is expected to be in
+/// place already: the lexer stops at the first plain separator the old hl
+/// also had, since the rest of the row then lexes exactly as it did before.
+void editorSyntaxLex(erow* row, unsigned char* hl, ssize_t i, int in_comment, ssize_t sync_from) {
+    struct keywordTable* keywords = E.syntax->keyword_table;
+    char* render = editorRowRender(row);
+
+    char* scs = E.syntax->singleline_comment_start;
+    char* mcs = E.syntax->multiline_comment_start;
+    char* mce = E.syntax->multiline_comment_end;
+
+    int scs_len = scs ? strlen(scs) : 0;
+    int mcs_len = mcs ? strlen(mcs) : 0;
+    int mce_len = mce ? strlen(mce) : 0;
+
+    int prev_sep = 1;
+    int in_string = 0;
+    int plain = 0;          // The last char was a separator outside any token
+    unsigned char old = 0;  // The old hl of that char
+
+    while(i < row->rsize) {
+        if (plain && old == HL_NORMAL && sync_from != -1 && i > sync_from) return;
+        plain = 0;
+
+        char c = render[i];
+        unsigned char prev_hl = (i > 0) ? hl[i-1] : HL_NORMAL;
+        ssize_t left = row->rsize - i; // A row rendered as its chars may not end in '\0'
+
+        /* If single line comments */
+        if (scs_len && !in_string && !in_comment) {
+            if (left >= scs_len && !memcmp(&render[i], scs, scs_len)) {
+                memset(&hl[i], HL_COMMENT, row->rsize - i);
+                break;
+            }
+        }
+
+        /* If multiline comments */
+        if (mcs_len && mce_len && !in_string) {
+            if (in_comment) {
+                hl[i] = HL_MLCOMMENT;
+                if (left >= mce_len && !memcmp(&render[i], mce, mce_len)) {
+                    memset(&hl[i], HL_MLCOMMENT, mce_len);
+                    i += mce_len;
+                    in_comment = 0;
+                    prev_sep = 1;
+                    continue;
+                } else {
+                    i++;
+                    continue;
+                }
+            } else if (left >= mcs_len && !memcmp(&render[i], mcs, mcs_len)) {
+                memset(&hl[i], HL_MLCOMMENT, mcs_len);
+                i += mcs_len;
+                in_comment = 1;
+                continue;
+            }
+        }
+
+        /* If String syntax flag set, highlight strings & characters */
+        if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
+            if (in_string) {
+                hl[i] = HL_STRING;
+
+                if (c == '\\' && i + 1 < row->rsize) {
+                    hl[i + 1] = HL_STRING;
+                    i += 2;
+                    continue;
+                }
+
+                if (c == in_string) in_string = 0;
+                i++;
+                prev_sep = 1;
+                continue;
+            } else {
+                if (c == '"' || c == '\'') {
+                    in_string = c;
+                    hl[i] = HL_STRING;
+                    i++;
+                    continue;
+                }
+            }
+        }
+
+        /* If Number syntax flag set, highlight numbers */
+        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+            if(isdigit(c) && (prev_sep || prev_hl == HL_NUMBER || (c == '.' && prev_hl == HL_NUMBER))) {
+                hl[i] = HL_NUMBER;
+                i++;
+                prev_sep;
+                continue;
+            }
+        }
+
+        if(prev_sep) {
+            // Keywords never contain separators, so only a whole token can match
+            ssize_t klen = 0;
+            while (i + klen < row->rsize && !is_separator(render[i + klen])) klen++;
+
+            struct keyword* kw = editorKeywordLookup(keywords, &render[i], klen);
+            if (kw) {
+                memset(&hl[i], kw->hl, klen);
+                i += klen;
+                prev_sep = 0;
+                continue;
+            }
+        }
+
+        old = hl[i];
+        hl[i] = HL_NORMAL;
+        prev_sep = is_separator(c);
+        plain = prev_sep;
+        i++;
+    }
+
+    // The row below is caught up lazily, so a newly opened comment costs
+    // nothing until the rows it swallows are drawn
+    int changed = (row->hl_open_comment != in_comment);
+    row->hl_open_comment = in_comment;
+    if (changed) editorInvalidateSyntax(editorRowIndex(row) + 1);
+}
+
+void editorUpdateSyntax(erow* row) {
+    long long span = profBegin();
+    editorRenderRow(row);
+    row->stale &= ~(ROW_STALE_HL | ROW_STALE_STATE);
+
+    unsigned char* hl = editorHlScratch(row->rsize);
+    memset(hl, HL_NORMAL, row->rsize);
+
+    if (E.syntax) {
+        erow* prev = editorRowAt(editorRowIndex(row) - 1);
+        editorSyntaxLex(row, hl, 0, prev && prev->hl_open_comment, -1);
+    }
+    editorRowPackHl(row, hl);
+    profEnd("highlight", "syntax", span);
+}
+
+/// @brief Highlight a row again into hl after its render changed in [from,
+/// to), the render & hl after that having been moved into place. Lexing
+/// resumes at the last plain separator before the change that no comment
+/// delimiter spans.
+void editorSyntaxPatch(erow* row, unsigned char* hl, ssize_t from, ssize_t to) {
+    if (E.syntax == NULL) {
+        memset(&hl[from], HL_NORMAL, to - from);
+        return;
+    }
+
+    ssize_t reach = 0; // How far a delimiter starting before `from` could reach into it
+    char* delims[] = {E.syntax->singleline_comment_start,
+        E.syntax->multiline_comment_start, E.syntax->multiline_comment_end};
+    for (unsigned int k = 0; k < sizeof(delims) / sizeof(delims[0]); k++) {
+        ssize_t len = delims[k] ? (ssize_t)strlen(delims[k]) : 0;
+        if (len - 1 > reach) reach = len - 1;
+    }
+
+    char* render = editorRowRender(row);
+    ssize_t p = from - reach;
+    if (p < 0) p = 0;
+    while (p > 0 && !(hl[p - 1] == HL_NORMAL && is_separator(render[p - 1]))) p--;
+
+    int in_comment = 0;
+    if (p == 0) {
+        erow* prev = editorRowAt(editorRowIndex(row) - 1);
+        in_comment = prev && prev->hl_open_comment;
+    }
+    editorSyntaxLex(row, hl, p, in_comment, to);
+}
+
+/* 31 = */
+int editorSyntaxToColor(int hl) {
+    switch (hl) {
+        case HL_MLCOMMENT:
+        case HL_COMMENT: return 35;// MAGENTA
+        case HL_KEYWORD1: return 31; // RED
+        case HL_KEYWORD2: return 34; // BLUE
+        case HL_NUMBER: return 36; // CYAN
+        case HL_STRING: return 32; // GREEN
+        case HL_MATCH: return 33;  // YELLOW
+        default: return 37;        // WHITE
+    }
+}
+
+void editorSelectSyntaxHighlight() {
+    E.syntax = NULL;
+    if(E.filename == NULL) return;
+
+    char* ext = strrchr(E.filename, '.');
+
+    for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
+        struct editorSyntax* s = &HLDB[j];
+        unsigned int i = 0;
+        while(s->filematch[i]) {
+            int is_ext = (s->filematch[i][0] == '.');
+            if((is_ext && ext && !strcmp(ext, s->filematch[i])) || (!is_ext && strstr(E.filename, s->filematch[i]))) {
+                E.syntax = s;
+                if (s->keyword_table == NULL) s->keyword_table = editorCompileKeywords(s->keywords);
+
+                // Rows are re-highlighted as they are drawn
+                int filerow;
+                for (filerow = 0; filerow < E.numrows; filerow++) {
+                    editorRowAt(filerow)->stale |= ROW_STALE_HL | ROW_STALE_STATE;
+                }
+                E.hl_stale_from = 0;
+
+                return;
+            }
+            i++;
+        }
+    }
+}
+
+/*** copy buffer ***/
+
+/// @brief Whether a row's chars are shared with the copy buffer
+int editorRowShared(erow* row) {
+    return row->copy_gen == E.copy.gen && E.copy.nspans;
+}
+
+/// @brief Take ownership of chars a row no longer uses but the copy buffer does
+void editorCopyAdopt(char* chars) {
+    if (E.copy.nowned == E.copy.owned_cap) {
+        E.copy.owned_cap = E.copy.owned_cap ? E.copy.owned_cap * 2 : 16;
+        E.copy.owned = realloc(E.copy.owned, sizeof(char*) * E.copy.owned_cap);
+        if (E.copy.owned == NULL) fail("realloc");
+    }
+    E.copy.owned[E.copy.nowned++] = chars;
+}
+
+void editorCopyClear() {
+    for (int j = 0; j < E.copy.nowned; j++) lineFree(E.copy.owned[j]);
+    free(E.copy.owned);
+    free(E.copy.spans);
+    // A new generation leaves every row stamped with the old one unshared
+    E.copy = (copyBuffer){NULL, 0, 0, 0, NULL, 0, 0, E.copy.gen + 1};
+}
+
+/// @brief Add text to the end of the copy buffer, extending the last span
+/// when the text follows on from it in memory, as lines of E.map do
+void editorCopyPush(char* p, ssize_t len, int nl) {
+    copySpan* last = E.copy.nspans ? &E.copy.spans[E.copy.nspans - 1] : NULL;
+    if (last && last->nl && last->p + last->len + 1 == p && last->p[last->len] == '\n') {
+        last->len += 1 + len;
+        last->nl = nl;
+    } else {
+        if (E.copy.nspans == E.copy.cap) {
+            E.copy.cap = E.copy.cap ? E.copy.cap * 2 : 16;
+            E.copy.spans = realloc(E.copy.spans, sizeof(copySpan) * E.copy.cap);
+            if (E.copy.spans == NULL) fail("realloc");
+        }
+        E.copy.spans[E.copy.nspans++] = (copySpan){p, len, nl};
+    }
+    E.copy.len += len + nl;
+}
+
+/// @brief Replace the copy buffer with the text from (sy, sx) up to (ey, ex).
+/// No text is copied; rows are only visited to note where their text lives.
+void editorCopyRange(ssize_t sy, ssize_t sx, ssize_t ey, ssize_t ex) {
+    editorCopyClear();
+
+    for (ssize_t y = sy; y <= ey; y++) {
+        erow* row = editorRowAt(y);
+        if (row == NULL) {
+            editorCopyPush("", 0, 0); // The empty line past the last row
+            break;
+        }
+
+        ssize_t from = (y == sy) ? sx : 0;
+        ssize_t to = (y == ey) ? ex : row->size;
+        if (!row->mapped) row->copy_gen = E.copy.gen;
+        editorCopyPush(&row->chars[from], to - from, y != ey);
+    }
+}
+
+/// @brief Write the copy buffer's text out to dst, which holds E.copy.len bytes
+void editorCopyExport(char* dst) {
+    for (int j = 0; j < E.copy.nspans; j++) {
+        copySpan* span = &E.copy.spans[j];
+        memcpy(dst, span->p, span->len);
+        dst += span->len;
+        if (span->nl) *dst++ = '\n';
+    }
+}
+
+/*** row operations ***/
+
+/// @brief Number of the row's tabs before chars position cx
+ssize_t editorRowTabsBefore(erow* row, ssize_t cx) {
+    rowTab* tabs = editorRowTabs(row);
+    ssize_t lo = 0, hi = row->ntabs;
+    while (lo < hi) {
+        ssize_t mid = lo + (hi - lo) / 2;
+        if (tabs[mid].cx < cx) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/// @brief Render column of cx, given the number k of tabs before it
+ssize_t editorRowTabRx(erow* row, ssize_t k, ssize_t cx) {
+    if (k == 0) return cx;
+    rowTab* tab = &editorRowTabs(row)[k - 1];
+    return tab->rx + (cx - tab->cx - 1);
+}
+
+/// @brief Convert cx to rx
+/// @param row row to convert
+ssize_t editorRowCxToRx(erow *row, ssize_t cx) {
+    editorRenderRow(row); // Brings the tab index up to date
+    return editorRowTabRx(row, editorRowTabsBefore(row, cx), cx);
+}
+
+ssize_t editorRowRxToCx(erow* row, ssize_t rx) {
+    editorRenderRow(row);
+
+    // Tabs [0, k) end at or before rx
+    rowTab* tabs = editorRowTabs(row);
+    ssize_t lo = 0, hi = row->ntabs;
+    while (lo < hi) {
+        ssize_t mid = lo + (hi - lo) / 2;
+        if (tabs[mid].rx <= rx) lo = mid + 1;
+        else hi = mid;
+    }
+    ssize_t k = lo;
+
+    ssize_t cx = k ? tabs[k - 1].cx + 1 + (rx - tabs[k - 1].rx) : rx;
+    if (k < row->ntabs && cx > tabs[k].cx) cx = tabs[k].cx; // rx is within tab k
+    return cx < row->size ? cx : row->size;
+}
+
+/// @brief Render chars [from, to) of a row at column rx, recording the tabs
+/// among them from tab k on. Room for them must already have been made.
+void editorRowRenderSpan(erow* row, ssize_t from, ssize_t to, ssize_t rx, ssize_t k) {
+    char* render = editorRowRender(row);
+    rowTab* tabs = editorRowTabs(row);
+
+    for (ssize_t j = from; j < to; j++) {
+        if (row->chars[j] == '\t') {
+            render[rx++] = ' ';
+            while (rx % TAB_STOP != 0) render[rx++] = ' ';
+            tabs[k++] = (rowTab){j, rx};
+        } else {
+            render[rx++] = row->chars[j];
+        }
+    }
+}
+
+/// @brief Rebuild a row's render & tab index from its chars, if it has changed
+/// since last time. Its hl runs go with the old render.
+void editorRenderRow(erow *row) {
+    if (!(row->stale & ROW_STALE_RENDER)) return;
+    row->stale &= ~ROW_STALE_RENDER;
+    row->stale |= ROW_STALE_HL;
+
+    ssize_t tabs = 0, rsize = 0;
+    for (ssize_t j = 0; j < row->size; j++) {
+        if (row->chars[j] == '\t') {
+            rsize += TAB_STOP - rsize % TAB_STOP;
+            tabs++;
+        } else {
+            rsize++;
+        }
+    }
+
+    row_aux_bytes -= editorRowAuxBytes(row);
+    free(row->aux);
+    row->aux = NULL;
+    row->ntabs = tabs;
+    row->nspans = 0;
+    row->rsize = rsize;
+    if (tabs == 0) return; // Rendered as its chars
+
+    row->aux = malloc(editorRowSpansOffset(tabs, rsize));
+    if (row->aux == NULL) fail("malloc");
+    row_aux_bytes += editorRowAuxBytes(row);
+    editorRowRenderSpan(row, 0, row->size, 0, 0);
+    editorRowRender(row)[rsize] = '\0';
+}
+
+/// @brief Mark a row's render & highlighting out of date. They are rebuilt on demand.
+void editorUpdateRow(erow *row) {
+    row->stale = ROW_STALE_RENDER | ROW_STALE_HL | ROW_STALE_STATE;
+
+    ssize_t at = editorRowIndex(row);
+    if (at < E.hl_stale_from) E.hl_stale_from = at;
+}
+
+/// @brief Bring a row's render, tab index & hl up to date after chars [at,
+/// at + del) were replaced by the ins chars now at [at, at + ins). Only the
+/// chars from there to the next tab are rendered again: past that tab the
+/// rest of the row lines up as before, so it is only moved. If the row has
+/// no render yet, it is just marked out of date.
+void editorUpdateRowSpan(erow* row, ssize_t at, ssize_t del, ssize_t ins) {
+    if (row->stale & ROW_STALE_RENDER) {
+        editorUpdateRow(row);
+        return;
+    }
+    long long span = profBegin();
+
+    // Old tabs [k0, k1) are redone. Past them the old render is moved as it is.
+    rowTab* old_tabs = editorRowTabs(row);
+    ssize_t old_ntabs = row->ntabs, old_rsize = row->rsize;
+    ssize_t k0 = editorRowTabsBefore(row, at);
+    ssize_t k1 = editorRowTabsBefore(row, at + del);
+    ssize_t rx0 = editorRowTabRx(row, k0, at);
+    ssize_t old_end, old_rx;
+    if (k1 < old_ntabs) {
+        old_end = old_tabs[k1].cx + 1;
+        old_rx = old_tabs[k1].rx;
+        k1++;
+    } else {
+        old_end = at + del;
+        old_rx = editorRowTabRx(row, k1, old_end);
+    }
+    ssize_t new_end = old_end - del + ins;
+
+    ssize_t new_rx = rx0, added = 0;
+    for (ssize_t j = at; j < new_end; j++) {
+        if (row->chars[j] == '\t') {
+            new_rx += TAB_STOP - new_rx % TAB_STOP;
+            added++;
+        } else {
+            new_rx++;
+        }
+    }
+    ssize_t delta = new_rx - old_rx;
+    ssize_t rsize = old_rsize + delta;
+    ssize_t ntabs = old_ntabs - (k1 - k0) + added;
+    int hl_valid = !(row->stale & (ROW_STALE_HL | ROW_STALE_STATE));
+
+    // Move the hl of what follows into place
+    unsigned char* hl = NULL;
+    if (hl_valid) {
+        hl = editorHlScratch(rsize > old_rsize ? rsize : old_rsize);
+        editorRowUnpackHl(row, hl);
+        memmove(&hl[new_rx], &hl[old_rx], old_rsize - old_rx);
+    }
+
+    // The tabs & render go into a new aux, the hl runs being packed after them
+    void* old_aux = row->aux;
+    char* old_render = old_ntabs ? editorRowRender(row) : NULL;
+    row_aux_bytes -= editorRowAuxBytes(row);
+    row->aux = NULL;
+    row->ntabs = ntabs;
+    row->nspans = 0;
+    row->rsize = rsize;
+
+    if (ntabs) {
+        row->aux = malloc(editorRowSpansOffset(ntabs, rsize));
+        if (row->aux == NULL) fail("malloc");
+        rowTab* tabs = editorRowTabs(row);
+        char* render = editorRowRender(row);
+
+        if (old_render) {
+            memcpy(tabs, old_tabs, sizeof(rowTab) * k0);
+            for (ssize_t k = k1; k < old_ntabs; k++)
+                tabs[k - k1 + k0 + added] = (rowTab){old_tabs[k].cx + ins - del, old_tabs[k].rx + delta};
+            memcpy(render, old_render, rx0);
+            memcpy(&render[new_rx], &old_render[old_rx], old_rsize - old_rx);
+        } else {
+            // The row rendered as its chars, which have already been moved
+            memcpy(render, row->chars, rx0);
+            memcpy(&render[new_rx], &row->chars[new_end], row->size - new_end);
+        }
+        render[rsize] = '\0';
+        editorRowRenderSpan(row, at, new_end, rx0, k0);
+        row_aux_bytes += editorRowAuxBytes(row);
+    }
+    free(old_aux);
+
+    if (hl_valid) {
+        editorSyntaxPatch(row, hl, rx0, new_rx);
+        editorRowPackHl(row, hl);
+    } else {
+        row->stale |= ROW_STALE_HL | ROW_STALE_STATE;
+        ssize_t y = editorRowIndex(row);
+        if (y < E.hl_stale_from) E.hl_stale_from = y;
+    }
+    profEnd("rows", "update span", span);
+}
+
+/// @brief Bring hl_open_comment up to date for every row above `at`.
+/// Each row's stored state is a checkpoint, so this resumes from the first
+/// row that may be wrong & only lexes comment state; hl waits until drawn.
+void editorSyntaxCatchUp(ssize_t at) {
+    if (E.hl_stale_from >= at) return;
+    long long span = profBegin();
+    if (at - E.hl_stale_from >= SYNTAX_PARALLEL_ROWS) editorSyntaxCatchUpParallel(at);
+
+    while (E.hl_stale_from < at) {
+        ssize_t j = E.hl_stale_from++;
+        erow* row = editorRowAt(j);
+        if (!(row->stale & ROW_STALE_STATE)) continue;
+
+        erow* prev = editorRowAt(j - 1);
+        int in_comment = editorSyntaxScanState(row, prev && prev->hl_open_comment);
+        row->stale &= ~ROW_STALE_STATE;
+        if (in_comment != row->hl_open_comment) {
+            row->hl_open_comment = in_comment;
+            editorInvalidateSyntax(j + 1);
+        }
+    }
+    profEnd("highlight", "catch up", span);
+}
+
+/// @brief Return row `at` with its render & highlighting up to date
+erow* editorPrepareRow(ssize_t at) {
+    if (editorSyntaxCarriesState()) editorSyntaxCatchUp(at);
+
+    erow* row = editorRowAt(at);
+    if (row->stale & ROW_STALE_HL) editorUpdateSyntax(row);
+    return row;
+}
+
+void editorInsertRow(ssize_t at, char* s, size_t len) {
+    if(at < 0 || at > E.numrows) return;
+
+    journalInsertRows(at, s, len, NULL, 0);
+    erow* row = editorRowStoreInsert(at);
+
+    row->size = len;
+    row->chars = lineAlloc(len+1);
+    memcpy(row->chars, s, len);
+    row->chars[len] = '\0';
+
+    row->rsize = 0;
+    row->aux = NULL;
+    row->ntabs = 0;
+    row->nspans = 0;
+    row->hl_open_comment = 0;
+    row->mapped = 0;
+    row->copy_gen = 0;
+    editorUpdateRow(row);
+    editorInvalidateSyntax(at + 1);
+
+    E.dirty++;
+}
+
+/// @brief Give a row its own heap copy of its text so it can be edited, if
+/// the text is mapped or shared with the copy buffer
+void editorRowMaterialize(erow* row) {
+    int shared = editorRowShared(row);
+    if (!row->mapped && !shared) return;
+
+    char* chars = lineAlloc(row->size + 1);
+    memcpy(chars, row->chars, row->size);
+    chars[row->size] = '\0';
+    if (shared) editorCopyAdopt(row->chars);
+    row->chars = chars;
+    row->mapped = 0;
+    row->copy_gen = 0;
+}
+
+void editorFreeRow(erow* row) {
+    if (editorRowShared(row)) editorCopyAdopt(row->chars);
+    else if (!row->mapped) lineFree(row->chars);
+    row_aux_bytes -= editorRowAuxBytes(row);
+    free(row->aux);
+}
+
+void editorDelRow(ssize_t at) {
+    if (at < 0 || at >= E.numrows) return;
+    journalDeleteRows(at, 1);
+    editorFreeRow(editorRowAt(at));
+    editorRowStoreDelete(at);
+    editorInvalidateSyntax(at);
+    E.dirty++;
+}
+
+void editorRowInsertChar(erow* row, ssize_t at, int c) {
+    if (at < 0 || at > row->size) {
+        at = row->size; // Interesting wraparound
+    }
+
+    char ch = c;
+    journalSplice(editorRowIndex(row), at, 0, &ch, 1);
+    editorRowMaterialize(row);
+    row->chars = lineResize(row->chars, row->size+2);
+    memmove(&row->chars[at+1], &row->chars[at], row->size - at + 1);
+    row->size++;
+    row->chars[at] = c;
+    editorUpdateRowSpan(row, at, 0, 1);
+    E.dirty++;
+}
+
+void editorRowInsertString(erow* row, ssize_t at, ssize_t len, char* cs) {
+    if (at < 0 || at > row->size) {
+        at = row->size;
+    }
+
+    journalSplice(editorRowIndex(row), at, 0, cs, len);
+    editorRowMaterialize(row);
+    row->chars = lineResize(row->chars, row->size + len + 1);
+    memmove(&row->chars[at+len], &row->chars[at], row->size - at + 1);
+    memcpy(&row->chars[at], cs, len);
+    row->size += len;
+    editorUpdateRowSpan(row, at, 0, len);
+    E.dirty++;
+}
+
+void editorRowAppendString(erow* row, char* s, size_t len) {
+    journalSplice(editorRowIndex(row), row->size, 0, s, len);
+    editorRowMaterialize(row);
+    row->chars = lineResize(row->chars, row->size + len + 1);
+    memcpy(&row->chars[row->size], s, len);
+    row->size += len;
+    row->chars[row->size] = '\0';
+    editorUpdateRowSpan(row, row->size - len, 0, len);
+    E.dirty++;
+}
+
+void editorRowDeleteChar(erow* row, ssize_t at) {
+    if (at < 0 || at >= row->size) return;
+
+    journalSplice(editorRowIndex(row), at, 1, NULL, 0);
+    editorRowMaterialize(row);
+    memmove(&row->chars[at], &row->chars[at+1], row->size - at);
+    row->size--;
+    editorUpdateRowSpan(row, at, 1, 0);
+    E.dirty++;
+}
+
+/*** editor operations ***/
+
+/// @brief Last line the cursor may go to. That is the line past the last row,
+/// where text typed goes into a new row, except while the file is loading,
+/// when the rows still to come belong there.
+ssize_t editorLastLine() {
+    return (E.loader && E.numrows) ? E.numrows - 1 : E.numrows;
+}
+
+void editorInsertChar(int c) {
+    if (E.cy == E.numrows) editorLoadFinish(); // Only before the first rows load
+    if(E.cy == E.numrows) {
+        editorInsertRow(E.numrows, "", 0);
+    }
+    editorRowInsertChar(editorRowAt(E.cy), E.cx, c);
+    E.cx++;
+}
+
+void editorInsertNewline() {
+    if (E.cy == E.numrows) editorLoadFinish(); // Only before the first rows load
     if(E.cx == 0) {
         editorInsertRow(E.cy, "", 0);
     } else {
-        erow* row = &E.row[E.cy];
+        erow* row = editorRowAt(E.cy);
         editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx); // Split the current row in 2. Divide @ cusor position.
-        row = &E.row[E.cy];
+        row = editorRowAt(E.cy);
+        journalSplice(E.cy, E.cx, row->size - E.cx, NULL, 0);
+        editorRowMaterialize(row);
+        ssize_t del = row->size - E.cx;
         row->size = E.cx;
         row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+        editorUpdateRowSpan(row, E.cx, del, 0);
     }
     E.cy++;
     E.cx = 0;
@@ -598,18 +2402,133 @@ void editorDeleteChar() {
     if(E.cy == E.numrows) return;
     if(E.cx == 0 && E.cy == 0) return;
 
-    erow* row = &E.row[E.cy];
+    erow* row = editorRowAt(E.cy);
     if(E.cx > 0) {
         editorRowDeleteChar(row, E.cx-1);
         E.cx--;
     } else {
-        E.cx = E.row[E.cy-1].size;
-        editorRowAppendString(&E.row[E.cy-1], row->chars, row->size);
+        E.cx = editorRowAt(E.cy-1)->size;
+        editorRowAppendString(editorRowAt(E.cy-1), row->chars, row->size);
         editorDelRow(E.cy);
         E.cy--;
     }
 }
 
+/// @brief Insert text at the cursor & leave the cursor after it. Text holding
+/// newlines is split into lines once, all of its new rows are added to the
+/// tree together & each touched row is marked for re-rendering only once.
+void editorInsertText(char* s, ssize_t len) {
+    long long span = profBegin();
+    if (E.cy == E.numrows) editorLoadFinish(); // Only before the first rows load
+    if (E.cy == E.numrows) {
+        editorInsertRow(E.numrows, "", 0);
+    }
+
+    char* nl = memchr(s, '\n', len);
+    if (nl == NULL) {
+        editorRowInsertString(editorRowAt(E.cy), E.cx, len, s);
+        E.cx += len;
+        profEnd("rows", "insert text", span);
+        return;
+    }
+
+    ssize_t n = 0; // Rows the text adds
+    for (char* p = nl; p; p = memchr(p + 1, '\n', s + len - p - 1)) n++;
+
+    ssize_t cx = E.cx;
+    editorRowStoreInsertMany(E.cy + 1, n);
+    erow* first = editorRowAt(E.cy);
+    char* tail = &first->chars[cx];
+    ssize_t taillen = first->size - cx;
+    journalSplice(E.cy, cx, taillen, s, nl - s);
+    journalInsertRows(E.cy + 1, nl + 1, s + len - nl - 1, tail, taillen);
+
+    // Fill the new rows. The last takes the rest of the cursor's row.
+    char* line = nl + 1;
+    for (ssize_t j = 1; j <= n; j++) {
+        char* end = (j < n) ? memchr(line, '\n', s + len - line) : s + len;
+        ssize_t linelen = end - line;
+        ssize_t size = linelen + (j == n ? taillen : 0);
+
+        erow* row = editorRowAt(E.cy + j);
+        row->size = size;
+        row->chars = lineAlloc(size + 1);
+        memcpy(row->chars, line, linelen);
+        if (j == n) memcpy(&row->chars[linelen], tail, taillen);
+        row->chars[size] = '\0';
+
+        row->rsize = 0;
+        row->aux = NULL;
+        row->ntabs = 0;
+        row->nspans = 0;
+        row->hl_open_comment = 0;
+        row->mapped = 0;
+        row->copy_gen = 0;
+        row->stale = ROW_STALE_RENDER | ROW_STALE_HL | ROW_STALE_STATE;
+
+        if (j == n) E.cx = linelen;
+        line = end + 1;
+    }
+
+    // The cursor's row keeps what came before the cursor, then the first line
+    editorRowMaterialize(first);
+    ssize_t firstlen = nl - s;
+    first->chars = lineResize(first->chars, cx + firstlen + 1);
+    memcpy(&first->chars[cx], s, firstlen);
+    first->size = cx + firstlen;
+    first->chars[first->size] = '\0';
+    editorUpdateRowSpan(first, cx, taillen, firstlen);
+    editorInvalidateSyntax(E.cy + 1);       // The new rows' comment state is still to find
+    editorInvalidateSyntax(E.cy + n + 1);   // & the row after them may start in another
+
+    E.cy += n;
+    E.dirty++;
+    profEnd("rows", "insert text", span);
+}
+
+/// @brief Delete the text from (sy, sx) up to (ey, ex) & leave the cursor at
+/// its start. Whole rows in between are dropped together, then what is left
+/// of the last row is joined onto the first, which is re-rendered once.
+void editorDeleteRange(ssize_t sy, ssize_t sx, ssize_t ey, ssize_t ex) {
+    if (sy >= E.numrows) return;
+    long long span = profBegin();
+
+    erow* first = editorRowAt(sy);
+    erow* last = editorRowAt(ey);
+    char* tail = last ? &last->chars[ex] : "";
+    ssize_t taillen = last ? last->size - ex : 0;
+    if (sy == ey) taillen = first->size - ex;
+    ssize_t n = (last ? ey : E.numrows - 1) - sy; // Rows after the first to drop
+
+    if (sy == ey) journalSplice(sy, sx, ex - sx, NULL, 0);
+    else journalSplice(sy, sx, first->size - sx, tail, taillen);
+    if (n > 0) journalDeleteRows(sy + 1, n);
+
+    // The first row takes the rest of the last before that is freed
+    ssize_t del = (sy == ey ? ex : first->size) - sx;
+    editorRowMaterialize(first);
+    if (sy == ey) {
+        memmove(&first->chars[sx], tail, taillen);
+    } else {
+        first->chars = lineResize(first->chars, sx + taillen + 1);
+        memcpy(&first->chars[sx], tail, taillen);
+    }
+    first->size = sx + taillen;
+    first->chars[first->size] = '\0';
+    editorUpdateRowSpan(first, sx, del, sy == ey ? 0 : taillen);
+
+    if (n > 0) {
+        for (ssize_t j = 1; j <= n; j++) editorFreeRow(editorRowAt(sy + j));
+        editorRowStoreDeleteMany(sy + 1, n);
+        editorInvalidateSyntax(sy + 1);
+    }
+
+    E.cy = sy;
+    E.cx = sx;
+    E.dirty++;
+    profEnd("rows", "delete range", span);
+}
+
 void editorStartSelecting() {
     editorSetStatusMessage("Selection: Use Arrows | Ctrl-E");
     E.selecting = 1;
@@ -624,286 +2543,1240 @@ void editorStopSelecting() {
     E.selection_start_y = 0;
 }
 
-int editorCollectSelection() {
-    if(E.selecting) {
-        int sel_start_y = E.dropped_cursor_y, sel_end_y = E.cy;
-        int sel_start_x = E.dropped_cursor_x, sel_end_x = E.cx;
+/// @brief Order the anchor & cursor into the selection bounds. This is O(1),
+/// so it can run on every cursor step.
+void editorCollectSelection() {
+    if(E.selecting) {
+        ssize_t sel_start_y = E.dropped_cursor_y, sel_end_y = E.cy;
+        ssize_t sel_start_x = E.dropped_cursor_x, sel_end_x = E.cx;
+
+        if(sel_start_y > sel_end_y || (sel_start_y == sel_end_y && sel_start_x > sel_end_x)) {
+            sel_start_x = sel_end_x; sel_start_y = sel_end_y;
+            sel_end_x = E.dropped_cursor_x; sel_end_y = E.dropped_cursor_y;
+        }
+
+        E.selection_start_x = sel_start_x;
+        E.selection_start_y = sel_start_y;
+        E.selection_end_y = sel_end_y;
+        E.selection_end_x = sel_end_x;
+    }
+}
+
+/// @brief copy the selection of characters to a buffer
+void editorSelectionCopy() {
+    if(E.selecting) {
+        editorCopyRange(E.selection_start_y, E.selection_start_x,
+            E.selection_end_y, E.selection_end_x);
+        editorSetStatusMessage("Copied %zd characters", E.copy.len);
+
+    } else {
+        // Display message.
+        editorSetStatusMessage("Copy failed: No selection (Ctrl-E & Arrow Keys)");
+    }
+
+    editorStopSelecting(); // Once copied, no need to be selecting anymore
+}
+
+/// @brief Paste characters from editor buffer
+void editorPaste() {
+    if (E.copy.nspans) {
+        char* text = malloc(E.copy.len + 1);
+        if (text == NULL) fail("malloc");
+        editorCopyExport(text);
+        editorInsertText(text, E.copy.len);
+        free(text);
+        editorSetStatusMessage("Pasted %zd characters @ %zd,%zd", E.copy.len, E.cx, E.cy);
+    } else {
+        editorSetStatusMessage("Paste failed: Copy buffer empty");
+    }
+}
+
+/// @brief Delete a selection of multiple characters
+void editorSelectionDelete() {
+    editorCollectSelection();
+    editorDeleteRange(E.selection_start_y, E.selection_start_x,
+        E.selection_end_y, E.selection_end_x);
+    editorStopSelecting();
+}
+
+void editorSelectionIndent() {
+    //Tab on selection to mass-indent
+    editorCollectSelection();
+    editorRowInsertChar(editorRowAt(E.selection_start_y), E.selection_start_x, '\t');
+
+    for(ssize_t i = 1; i <= E.selection_end_y - E.selection_start_y; i++)
+    {
+        editorRowInsertChar(editorRowAt(E.selection_start_y + i), E.selection_start_x, '\t');
+    }
+}
+
+void editorSelectionUnindent() {
+    editorCollectSelection();
+
+    ssize_t first_indent = E.selection_start_x == 0 ? 0 : E.selection_start_x - 1;
+    if(editorRowAt(E.selection_start_y)->chars[first_indent] == '\t') {
+        editorRowDeleteChar(editorRowAt(E.selection_start_y), first_indent);
+    }
+
+    for(ssize_t i = 1; i <= E.selection_end_y - E.selection_start_y; i++)
+    {
+        if(editorRowAt(E.selection_start_y + i)->chars[0] == '\t') {
+            editorRowDeleteChar(editorRowAt(E.selection_start_y + i), 0);
+        }
+    }
+}
+
+/*** file IO ***/
+
+/*
+ * A mapped file's lines are indexed by a loader thread, so the first screen
+ * is drawn as soon as its lines are found rather than once the whole file is.
+ * The loader builds rows into blocks of its own & hands them over as a tree,
+ * which the main thread joins onto the end of the buffer when woken. Only the
+ * main thread ever changes the buffer, so edits made meanwhile are ordered
+ * before the rows still to come, & rows aren't handed over while a search
+ * worker is reading the tree.
+ */
+
+#define LOAD_FIRST_ROWS 1024    // Rows in the first batch, more than a screen
+#define LOAD_MAX_ROWS (1 << 16) // Batches double in size up to this
+
+/*
+ * Mapped rows read the file itself, so if another program truncates it,
+ * touching the pages past its new end raises SIGBUS, which would take the
+ * buffer's edits down with the editor. Instead the vanished pages are
+ * replaced with zeroed ones: the text that was there reads as NULs from then
+ * on, & is saved as such, & the user is told. A page the kernel reads for
+ * us, as writev does when saving, fails with EFAULT instead & is touched so
+ * that the same happens.
+ */
+
+volatile sig_atomic_t map_truncated = 0; // Part of E.map vanished since last reported
+long map_page = 4096;                    // Page size, looked up before the handler needs it
+
+void handleSigbus(int sig, siginfo_t* info, void* ctx) {
+    (void)ctx;
+    char* addr = info->si_addr;
+    if (E.map && addr >= E.map && addr < E.map + E.map_len) {
+        int saved = errno;
+        char* from = E.map + (addr - E.map) / map_page * map_page;
+        void* zeroed = mmap(from, E.map + E.map_len - from, PROT_READ,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        errno = saved;
+        if (zeroed != MAP_FAILED) {
+            map_truncated = 1;
+            return; // The read is retried from the zeroed page
+        }
+    }
+    signal(sig, SIG_DFL); // Not ours to mend: fault again & die as usual
+}
+
+/// @brief Read a byte of every page of [p, p + len) that lies in E.map, so
+/// any that vanished are replaced by handleSigbus
+void editorMapTouch(const char* p, size_t len) {
+    if (E.map == NULL || p + len <= E.map || p >= E.map + E.map_len) return;
+    if (p < E.map) {
+        len -= E.map - p;
+        p = E.map;
+    }
+    if (p + len > E.map + E.map_len) len = E.map + E.map_len - p;
+
+    volatile char sink;
+    for (size_t k = 0; k < len; k += map_page) sink = p[k];
+    sink = p[len - 1];
+    (void)sink;
+}
+
+struct loader {
+    pthread_t thread;
+    pthread_mutex_t lock;
+
+    // Guarded by lock
+    rowblock* ready;    // Rows found but not yet in the buffer
+    size_t ready_end;   // Offset in E.map the rows found so far reach
+    int done;
+
+    // Main thread only
+    size_t published;   // Offset in E.map the rows in the buffer reach
+};
+
+void* loadWorker(void* arg) {
+    struct loader* l = arg;
+    char* p = E.map;
+    char* end = E.map + E.map_len;
+    ssize_t batch = LOAD_FIRST_ROWS;
+
+    while (p < end) {
+        long long span = profBegin();
+        rowblock* tree = NULL;
+        ssize_t n = 0;
+        while (p < end && n < batch) {
+            rowblock* b = rowblockNew();
+            for (; p < end && b->numrows < ROWS_PER_BLOCK && n < batch; n++) {
+                char* nl = memchr(p, '\n', end - p);
+                ssize_t linelen = (nl ? nl : end) - p;
+                while (linelen > 0 && p[linelen - 1] == '\r')
+                    linelen--;
+
+                erow* row = &b->rows[b->numrows++];
+                row->size = linelen;
+                row->chars = p;
+                row->rsize = 0;
+                row->aux = NULL;
+                row->ntabs = 0;
+                row->nspans = 0;
+                row->hl_open_comment = 0;
+                row->mapped = 1;
+                row->copy_gen = 0;
+                row->stale = ROW_STALE_RENDER | ROW_STALE_HL | ROW_STALE_STATE;
+                p = nl ? nl + 1 : end;
+            }
+            rowblockAdopt(b, 0, b->numrows);
+            rowblockPull(b);
+            tree = rowblockMerge(tree, b);
+        }
+
+        pthread_mutex_lock(&l->lock);
+        int wake = l->ready == NULL; // Otherwise the main thread has yet to take the last
+        l->ready = rowblockMerge(l->ready, tree);
+        l->ready_end = p - E.map;
+        pthread_mutex_unlock(&l->lock);
+        if (wake) write(E.load_pipe[1], "", 1);
+        profEnd("load", "batch", span);
+
+        if (batch < LOAD_MAX_ROWS) batch *= 2;
+    }
+
+    pthread_mutex_lock(&l->lock);
+    l->done = 1;
+    pthread_mutex_unlock(&l->lock);
+    write(E.load_pipe[1], "", 1);
+    return NULL;
+}
+
+/// @brief Join the rows the loader has ready onto the end of the buffer
+/// @return whether the loader has finished
+int editorLoadAdopt(struct loader* l) {
+    pthread_mutex_lock(&l->lock);
+    rowblock* ready = l->ready;
+    l->ready = NULL;
+    size_t end = l->ready_end;
+    int done = l->done;
+    pthread_mutex_unlock(&l->lock);
+
+    if (ready) {
+        long long span = profBegin();
+        ssize_t at = E.numrows;
+        editorSetRowRoot(rowblockMerge(E.rows, ready));
+        if (at < E.hl_stale_from) E.hl_stale_from = at;
+        l->published = end;
+        profEnd("load", "adopt", span);
+    }
+    return done;
+}
+
+/// @brief Wait until the whole file is in the buffer
+void editorLoadFinish() {
+    if (E.loader == NULL) return;
+    long long span = profBegin();
+    pthread_join(E.loader->thread, NULL);
+    profEnd("load", "wait", span);
+    editorLoadAdopt(E.loader);
+    pthread_mutex_destroy(&E.loader->lock);
+    free(E.loader);
+    E.loader = NULL;
+}
+
+/// @brief Take whatever the loader has found since it last woke the editor
+void editorLoadPublish() {
+    char drain[64];
+    while (read(E.load_pipe[0], drain, sizeof(drain)) > 0);
+
+    if (E.loader == NULL || E.search) return; // The search worker reads the tree unlocked
+    if (editorLoadAdopt(E.loader)) editorLoadFinish();
+}
+
+/// @brief Map a regular file & start indexing its lines without copying them
+/// @return 0 on success, -1 if the file can't be mapped
+int editorOpenMapped(char* filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+
+    char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    // Outlive the file being truncated under the mapping
+    map_page = sysconf(_SC_PAGESIZE);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = handleSigbus;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGBUS, &sa, NULL) == -1) fail("sigaction");
+
+    E.map = map;
+    E.map_len = st.st_size;
+
+    struct loader* l = calloc(1, sizeof(struct loader));
+    if (l == NULL) fail("calloc");
+    pthread_mutex_init(&l->lock, NULL);
+    E.loader = l;
+    if (pthread_create(&l->thread, NULL, loadWorker, l) != 0) fail("pthread_create");
+    return 0;
+}
+
+void editorOpen(char* filename) {
+    long long span = profBegin();
+    free(E.filename);
+    E.filename = strdup(filename);
+
+    editorSelectSyntaxHighlight();
+
+    if (editorOpenMapped(filename) == -1) {
+        FILE* fp = fopen(filename, "r");
+        if(!fp) fail("fopen");
+
+        char* line = NULL;
+        size_t linecap = 0;
+        ssize_t linelen;
+        while((linelen = getline(&line, &linecap, fp)) != -1) {
+            while(linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+                linelen--;
+            editorInsertRow(E.numrows, line, linelen);
+        }
+        free(line);
+        fclose(fp);
+    }
+    E.dirty = 0;
+
+    journalOpen(filename); // Puts back edits a crash lost
+    profEnd("load", "open", span);
+}
+
+/*
+ * Saving streams rows into a temporary file beside the target with writev,
+ * never building the whole file in memory, then syncs it & renames it over
+ * the target. A crash part way leaves either the old file or the new one.
+ * Since the old file is replaced rather than overwritten, a mapping of it
+ * stays valid & mapped rows need no copying first.
+ */
+
+#define SAVE_IOV 1024 // Buffers handed to each writev
+
+/// @brief Write every buffer of iov, resuming after partial writes
+/// @return 0 on success, -1 on error
+int writevAll(int fd, struct iovec* iov, int cnt) {
+    int faulted = 0;
+    while (cnt > 0) {
+        ssize_t n = writev(fd, iov, cnt);
+        if (n == -1 && errno == EFAULT && !faulted) {
+            // Part of the file mapping may have vanished; zero it & retry
+            for (int k = 0; k < cnt; k++) editorMapTouch(iov[k].iov_base, iov[k].iov_len);
+            faulted = 1;
+            continue;
+        }
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/// @brief Write every row to fd, each followed by a newline. Consecutive
+/// rows of E.map are still contiguous there, so they go out as one buffer.
+/// @return bytes written, or -1 on error
+ssize_t editorWriteRows(int fd) {
+    struct iovec iov[SAVE_IOV];
+    int cnt = 0;
+    ssize_t total = 0;
+
+    for (ssize_t j = 0; j < E.numrows; j++) {
+        erow* row = editorRowAt(j);
+        int inplace = row->mapped && row->chars + row->size < E.map + E.map_len &&
+            row->chars[row->size] == '\n'; // Row & its newline can be written from E.map
+        struct iovec* last = cnt ? &iov[cnt - 1] : NULL;
+
+        if (inplace && last && (char*)last->iov_base + last->iov_len == row->chars) {
+            last->iov_len += row->size + 1;
+        } else if (inplace) {
+            if (cnt == SAVE_IOV) {
+                if (writevAll(fd, iov, cnt) == -1) return -1;
+                cnt = 0;
+            }
+            iov[cnt++] = (struct iovec){row->chars, row->size + 1};
+        } else {
+            if (cnt + 2 > SAVE_IOV) {
+                if (writevAll(fd, iov, cnt) == -1) return -1;
+                cnt = 0;
+            }
+            iov[cnt++] = (struct iovec){row->chars, row->size};
+            iov[cnt++] = (struct iovec){"\n", 1};
+        }
+        total += row->size + 1;
+    }
+
+    if (cnt && writevAll(fd, iov, cnt) == -1) return -1;
+    return total;
+}
+
+/// @brief Flush a directory entry change, such as a rename, to disk
+void fsyncDir(const char* path) {
+    char* slash = strrchr(path, '/');
+    char* dir = slash ? strndup(path, slash == path ? 1 : slash - path) : strdup(".");
+    if (dir == NULL) fail("strdup");
+    int fd = open(dir, O_RDONLY);
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+}
+
+void editorSave() {
+    if (E.filename == NULL) {
+        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+        if (E.filename == NULL) {
+            editorSetStatusMessage("No filename given. Save aborted.");
+            return;
+        }
+        editorSelectSyntaxHighlight();
+    }
+
+    editorLoadFinish(); // The rows not loaded yet are part of the file too
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long long span = profBegin();
+
+    // Replace what a symlink points at rather than the link itself
+    char* target = realpath(E.filename, NULL);
+    if (target == NULL) target = strdup(E.filename);
+    if (target == NULL) fail("strdup");
+
+    mode_t mode = 0644;
+    struct stat st;
+    if (stat(target, &st) == 0) {
+        mode = st.st_mode & 07777;
+    } else {
+        mode_t mask = umask(0);
+        umask(mask);
+        mode &= ~mask;
+    }
+
+    size_t tmplen = strlen(target) + 16;
+    char* tmp = malloc(tmplen);
+    if (tmp == NULL) fail("malloc");
+    snprintf(tmp, tmplen, "%s.flit-XXXXXX", target);
+
+    ssize_t len = -1;
+    int fd = mkstemp(tmp);
+    if (fd != -1) {
+        long long write_span = profBegin();
+        if (fchmod(fd, mode) != -1) len = editorWriteRows(fd);
+        profEnd("save", "write", write_span);
+        long long sync_span = profBegin();
+        if (len != -1 && fsync(fd) == -1) len = -1;
+        profEnd("save", "fsync", sync_span);
+        if (close(fd) == -1) len = -1;
+        if (len != -1 && rename(tmp, target) == -1) len = -1;
+
+        int err = errno;
+        if (len == -1) unlink(tmp);
+        else fsyncDir(target);
+        errno = err;
+    }
+    free(tmp);
+    free(target);
+
+    if (len == -1) {
+        editorSetStatusMessage("Write failed. IO error: %s", strerror(errno));
+        profEnd("save", "save", span);
+        return;
+    }
+
+    // The journal's edits are in the file now; start one against the new version
+    journalClose(1);
+    journalOpen(E.filename);
+    profEnd("save", "save", span);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    E.dirty = 0;
+    editorSetStatusMessage("%zd bytes written to disk in %.0f ms (%.1f MB/s)",
+        len, secs * 1e3, secs > 0 ? len / secs / 1e6 : 0.0);
+}
+
+/*** journal ***/
+
+/*
+ * Every row edit is appended to a journal beside the file as a small binary
+ * record, so unsaved work survives a crash at a cost set by the edit rather
+ * than the file. The editor only copies records into memory. A writer thread
+ * hands them to the file & fdatasyncs it at most every JOURNAL_SYNC_MS, so a
+ * burst of edits shares one sync. On open, a journal left behind for the same
+ * version of the file is replayed over it; saving starts a new one.
+ *
+ * A record is an op byte, its fields as varints, any text, then an FNV-1a
+ * checksum of all of that. Replay stops at the first torn or damaged record.
+ */
+
+#define JOURNAL_SYNC_MS 250    // Longest a record waits before being synced
+#define JOURNAL_MAGIC "FLITJNL1"
+
+enum journalOp {
+    J_INSERT = 1,   // at, len, text: rows inserted at `at`, one per line of text
+    J_DELETE,       // at, n: n rows removed from `at`
+    J_SPLICE        // y, x, del, len, text: del chars of row y at x replaced by text
+};
+
+typedef struct journalHeader {
+    char magic[8];
+    int64_t size;   // Identity of the file version the records apply to
+    int64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+} journalHeader;
+
+struct journal {
+    int fd;
+    char* path;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+
+    // Guarded by lock
+    char* buf;      // Records not yet taken by the writer
+    ssize_t len;
+    ssize_t cap;
+    ssize_t rec;    // Offset in buf of the record being built
+    int stop;
+    int err;        // errno of a failed write, 0 if none
+};
+
+void journalReserve(struct journal* j, ssize_t n) {
+    if (j->len + n <= j->cap) return;
+    ssize_t cap = j->cap ? j->cap : 4096;
+    while (cap < j->len + n) cap *= 2;
+    char* buf = realloc(j->buf, cap);
+    if (buf == NULL) fail("realloc");
+    j->buf = buf;
+    j->cap = cap;
+}
+
+void journalPutBytes(struct journal* j, const char* s, ssize_t len) {
+    if (len == 0) return;
+    journalReserve(j, len);
+    memcpy(&j->buf[j->len], s, len);
+    j->len += len;
+}
+
+/// @brief Append v as an unsigned LEB128 varint
+void journalPutNum(struct journal* j, ssize_t v) {
+    uint64_t u = v;
+    journalReserve(j, 10);
+    do {
+        unsigned char b = u & 0x7f;
+        u >>= 7;
+        j->buf[j->len++] = b | (u ? 0x80 : 0);
+    } while (u);
+}
+
+uint32_t journalChecksum(const char* s, ssize_t len) {
+    uint32_t h = 2166136261u;
+    for (ssize_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/// @brief Start a record, holding the lock until journalEnd
+/// @return 0 if nothing is being journaled
+int journalBegin(int op) {
+    struct journal* j = E.journal;
+    if (j == NULL) return 0;
+    pthread_mutex_lock(&j->lock);
+    j->rec = j->len;
+    journalReserve(j, 1);
+    j->buf[j->len++] = op;
+    return 1;
+}
+
+void journalEnd() {
+    struct journal* j = E.journal;
+    uint32_t sum = journalChecksum(&j->buf[j->rec], j->len - j->rec);
+    journalPutBytes(j, (char*)&sum, sizeof(sum));
+    pthread_cond_signal(&j->wake);
+
+    int err = j->err;
+    j->err = 0;
+    pthread_mutex_unlock(&j->lock);
+    if (err) editorSetStatusMessage("Journal write failed: %s", strerror(err));
+}
+
+/// @brief Record rows inserted at `at`, one per line of s, the last of them
+/// followed by tail
+void journalInsertRows(ssize_t at, const char* s, ssize_t len, const char* tail, ssize_t taillen) {
+    if (!journalBegin(J_INSERT)) return;
+    journalPutNum(E.journal, at);
+    journalPutNum(E.journal, len + taillen);
+    journalPutBytes(E.journal, s, len);
+    journalPutBytes(E.journal, tail, taillen);
+    journalEnd();
+}
+
+void journalDeleteRows(ssize_t at, ssize_t n) {
+    if (!journalBegin(J_DELETE)) return;
+    journalPutNum(E.journal, at);
+    journalPutNum(E.journal, n);
+    journalEnd();
+}
 
-        if(sel_start_y > sel_end_y || (sel_start_y == sel_end_y && sel_start_x > sel_end_x)) {
-            sel_start_x = sel_end_x; sel_start_y = sel_end_y;
-            sel_end_x = E.dropped_cursor_x; sel_end_y = E.dropped_cursor_y;
-        }
+/// @brief Record del chars of row y at x being replaced by s
+void journalSplice(ssize_t y, ssize_t x, ssize_t del, const char* s, ssize_t len) {
+    if (!journalBegin(J_SPLICE)) return;
+    journalPutNum(E.journal, y);
+    journalPutNum(E.journal, x);
+    journalPutNum(E.journal, del);
+    journalPutNum(E.journal, len);
+    journalPutBytes(E.journal, s, len);
+    journalEnd();
+}
 
-        int count = 0;
-        if (sel_end_y == sel_start_y) {
-            // Same line
-            count = sel_end_x - sel_start_x;
-        } else {
-            // First line
-            count += E.row[sel_start_y].size - sel_start_x;
+void* journalWriter(void* arg) {
+    struct journal* j = arg;
+    char* out = NULL;
+    ssize_t outcap = 0;
+
+    pthread_mutex_lock(&j->lock);
+    while (1) {
+        while (!j->stop && j->len == 0) pthread_cond_wait(&j->wake, &j->lock);
+
+        // Let the records of a burst of edits gather, so they share one sync
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += JOURNAL_SYNC_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        while (!j->stop && pthread_cond_timedwait(&j->wake, &j->lock, &deadline) != ETIMEDOUT);
+        if (j->len == 0) break; // Only once stopped
+
+        // Take the records, leaving the editor an empty buffer to fill
+        char* buf = j->buf;
+        ssize_t len = j->len, cap = j->cap;
+        j->buf = out;
+        j->cap = outcap;
+        j->len = 0;
+        out = buf;
+        outcap = cap;
+        pthread_mutex_unlock(&j->lock);
+
+        struct iovec iov = {out, len};
+        int err = 0;
+        if (writevAll(j->fd, &iov, 1) == -1 || fdatasync(j->fd) == -1) err = errno;
+
+        pthread_mutex_lock(&j->lock);
+        if (err) j->err = err;
+    }
+    pthread_mutex_unlock(&j->lock);
+    free(out);
+    return NULL;
+}
 
-            // Complete lines in range
-            for (int i = sel_start_y + 1; i < sel_end_y; i++) {
-                count++; // Newline
-                count += E.row[i].size;
-            }
+/// @brief Path of the journal for a file: .name.flit-journal beside it
+char* journalPath(const char* filename) {
+    const char* slash = strrchr(filename, '/');
+    int dirlen = slash ? slash - filename + 1 : 0;
+    size_t len = strlen(filename) + 16;
+    char* path = malloc(len);
+    if (path == NULL) fail("malloc");
+    snprintf(path, len, "%.*s.%s.flit-journal", dirlen, filename, filename + dirlen);
+    return path;
+}
 
-            // Last line
-            count++; // Newline
-            count += sel_end_x;
+/// @brief Read an unsigned LEB128 varint at *p, not going past end
+/// @return 0 on success, -1 if it is cut short or out of range
+int journalGetNum(char** p, char* end, ssize_t* v) {
+    uint64_t u = 0;
+    for (int shift = 0; *p < end && shift < 63; shift += 7) {
+        unsigned char b = *(*p)++;
+        u |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = u;
+            return *v < 0 ? -1 : 0;
         }
+    }
+    return -1;
+}
 
-        E.selection_start_x = sel_start_x;
-        E.selection_start_y = sel_start_y;
-        E.selection_end_y = sel_end_y;
-        E.selection_end_x = sel_end_x;
-
-        return count;
+/// @brief Check the record at *p & apply it to the rows, moving *p past it
+/// @return 0 on success, -1 if it is torn, damaged or doesn't fit the rows
+int journalReplay(char** p, char* end) {
+    char* q = *p;
+    int op = (unsigned char)*q++;
+    int nfields = op == J_INSERT ? 2 : op == J_DELETE ? 2 : op == J_SPLICE ? 4 : 0;
+    if (nfields == 0) return -1;
+
+    ssize_t f[4];
+    for (int i = 0; i < nfields; i++) {
+        if (journalGetNum(&q, end, &f[i]) == -1) return -1;
+    }
+    char* text = q;
+    ssize_t len = op == J_DELETE ? 0 : f[nfields - 1];
+    uint32_t sum;
+    if (len > end - q || end - q - len < (ssize_t)sizeof(sum)) return -1;
+    q += len;
+    memcpy(&sum, q, sizeof(sum));
+    if (sum != journalChecksum(*p, q - *p)) return -1;
+
+    if (op == J_INSERT) {
+        ssize_t at = f[0];
+        if (at > E.numrows) return -1;
+        char* line = text;
+        while (1) {
+            char* nl = memchr(line, '\n', text + len - line);
+            ssize_t linelen = (nl ? nl : text + len) - line;
+            editorInsertRow(at++, line, linelen);
+            if (nl == NULL) break;
+            line = nl + 1;
+        }
+    } else if (op == J_DELETE) {
+        ssize_t at = f[0], n = f[1];
+        if (n == 0 || n > E.numrows - at) return -1;
+        for (ssize_t j = 0; j < n; j++) editorFreeRow(editorRowAt(at + j));
+        editorRowStoreDeleteMany(at, n);
+        editorInvalidateSyntax(at);
+        E.dirty++;
     } else {
-        return 0;
+        ssize_t y = f[0], x = f[1], del = f[2];
+        erow* row = editorRowAt(y);
+        if (row == NULL || x > row->size || del > row->size - x) return -1;
+        editorRowMaterialize(row);
+        row->chars = lineResize(row->chars, row->size - del + len + 1);
+        memmove(&row->chars[x + len], &row->chars[x + del], row->size - x - del + 1);
+        memcpy(&row->chars[x], text, len);
+        row->size += len - del;
+        editorUpdateRowSpan(row, x, del, len);
+        E.dirty++;
     }
+
+    *p = q + sizeof(sum);
+    return 0;
 }
 
-/// @brief copy the selection of characters to a buffer
-void editorSelectionCopy() {
-    if(E.selecting) {
-        int buffer_len = editorCollectSelection();
+/// @brief Identity of the file version a journal's records apply to
+/// @return 0 on success, -1 if the file can't be stat'd
+int journalHeaderFor(const char* filename, journalHeader* h) {
+    struct stat st;
+    if (stat(filename, &st) == -1) return -1;
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, JOURNAL_MAGIC, sizeof(h->magic));
+    h->size = st.st_size;
+    h->ino = st.st_ino;
+    h->mtime_sec = st.st_mtim.tv_sec;
+    h->mtime_nsec = st.st_mtim.tv_nsec;
+    return 0;
+}
 
-        // Now iterate through all the characters to copy & append them to buffer
-        char* buffer = malloc(buffer_len + 1); // Null terminated string
-        int index = 0;
+/// @brief Start journaling edits to the file, first replaying whatever a
+/// crash left in its journal
+void journalOpen(const char* filename) {
+    journalHeader h;
+    if (journalHeaderFor(filename, &h) == -1) return;
+
+    char* path = journalPath(filename);
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0600);
+    if (fd == -1) {
+        editorSetStatusMessage("Not journaling: %s", strerror(errno));
+        free(path);
+        return;
+    }
 
-        if (E.selection_end_y == E.selection_start_y) {
-            strncpy(buffer, &E.row[E.selection_end_y].chars[E.selection_start_x], buffer_len);
-            buffer[buffer_len] = '\0';
-        } else {
-            strncpy(buffer, &E.row[E.selection_start_y].chars[E.selection_start_x], E.row[E.selection_start_y].size - E.selection_start_x);
-            index += E.row[E.selection_start_y].size - E.selection_start_x; // No. Characters from first line
-
-            for (int i = E.selection_start_y + 1; i < E.selection_end_y; i++) {
-                buffer[index] = '\n';
-                index++;
-                strncpy(&buffer[index], E.row[i].chars, E.row[i].size);
-                index += E.row[i].size;
+    // Replay the records that made it to disk, if they are for this version
+    off_t keep = 0;
+    ssize_t replayed = 0;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(h)) {
+        char* old = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (old != MAP_FAILED) {
+            if (memcmp(old, &h, sizeof(h)) == 0) {
+                if (st.st_size > (off_t)sizeof(h)) editorLoadFinish(); // Records assume every row
+                char* p = old + sizeof(h);
+                while (p < old + st.st_size && journalReplay(&p, old + st.st_size) == 0) replayed++;
+                keep = p - old;
             }
-
-            buffer[index] = '\n';
-            index++;
-            strncpy(&buffer[index], E.row[E.selection_end_y].chars, E.selection_end_x); // Last characters on last line
-            buffer[index + E.selection_end_x] = '\0'; // EOS
+            munmap(old, st.st_size);
         }
+    }
 
-        if(E.copy_buffer) free(E.copy_buffer);
-        E.copy_buffer = buffer;
-        E.copy_buffer_len = buffer_len;
-        editorSetStatusMessage("Copied %d characters", buffer_len);
+    // Drop a torn tail, or start over against this version
+    if (keep == 0) {
+        if (ftruncate(fd, 0) == -1 || write(fd, &h, sizeof(h)) != sizeof(h)) keep = -1;
+        else fsyncDir(path);
+    } else if (keep < st.st_size && ftruncate(fd, keep) == -1) {
+        keep = -1;
+    }
+    if (keep == -1) {
+        editorSetStatusMessage("Not journaling: %s", strerror(errno));
+        close(fd);
+        free(path);
+        return;
+    }
 
-    } else {
-        // Display message.
-        editorSetStatusMessage("Copy failed: No selection (Ctrl-E & Arrow Keys)");
+    struct journal* j = calloc(1, sizeof(struct journal));
+    if (j == NULL) fail("calloc");
+    j->fd = fd;
+    j->path = path;
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&j->wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    E.journal = j;
+    if (pthread_create(&j->writer, NULL, journalWriter, j) != 0) fail("pthread_create");
+
+    if (replayed) {
+        editorSetStatusMessage("Recovered %zd unsaved edits from %s. Ctrl-S to keep them",
+            replayed, path);
     }
+}
 
-    editorStopSelecting(); // Once copied, no need to be selecting anymore
+/// @brief Stop journaling. Pending records are written out first, unless
+/// `discard`, in which case the journal is deleted instead.
+void journalClose(int discard) {
+    struct journal* j = E.journal;
+    if (j == NULL) return;
+    E.journal = NULL;
+
+    pthread_mutex_lock(&j->lock);
+    if (discard) j->len = 0;
+    j->stop = 1;
+    pthread_cond_signal(&j->wake);
+    pthread_mutex_unlock(&j->lock);
+    pthread_join(j->writer, NULL);
+
+    close(j->fd);
+    if (discard) unlink(j->path);
+    pthread_mutex_destroy(&j->lock);
+    pthread_cond_destroy(&j->wake);
+    free(j->buf);
+    free(j->path);
+    free(j);
 }
 
-/// @brief Paste characters from editor buffer
-void editorPaste() {
-    if (E.copy_buffer) {
-        if(E.cy == E.numrows) {
-            editorInsertRow(E.numrows, "", 0);
-        }
+/*** find ***/
 
-        for (int i = 0; i < E.copy_buffer_len; i++) {
-            if(E.copy_buffer[i] == '\n') {
-                editorInsertNewline();
-            } else {
-                editorInsertChar(E.copy_buffer[i]);
-            }
+/*
+ * Search runs over each row's raw chars. Candidates are found 16 bytes at a
+ * time by comparing the first two bytes of the query against two offset
+ * loads, and only those are compared in full.
+ */
+
+/// @brief Find the first occurrence of q[0..qlen) in s[0..len)
+/// @return offset of the match, or -1
+long searchBytes(const char* s, size_t len, const char* q, size_t qlen) {
+    if (qlen == 0 || qlen > len) return -1;
+    if (qlen == 1) {
+        const char* p = memchr(s, q[0], len);
+        return p ? p - s : -1;
+    }
+
+    size_t last = len - qlen; // Last offset a match can start at
+    size_t i = 0;
+
+#ifdef __SSE2__
+    __m128i first = _mm_set1_epi8(q[0]);
+    __m128i second = _mm_set1_epi8(q[1]);
+    for (; i + 17 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(s + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(s + i + 1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, second)));
+
+        while (mask) {
+            size_t pos = i + __builtin_ctz(mask);
+            if (pos > last) return -1;
+            if (!memcmp(s + pos + 2, q + 2, qlen - 2)) return pos;
+            mask &= mask - 1;
         }
+    }
+#endif
 
-        editorSetStatusMessage("Pasted %d characters @ %d,%d", E.copy_buffer_len, E.cx, E.cy);
-    } else {
-        editorSetStatusMessage("Paste failed: Copy buffer empty");
+    for (; i <= last; i++) {
+        if (s[i] == q[0] && s[i + 1] == q[1] && !memcmp(s + i + 2, q + 2, qlen - 2)) return i;
     }
+    return -1;
 }
 
-/// @brief Delete a selection of multiple characters
-void editorSelectionDelete() {
-    int numCharsToDelete = editorCollectSelection();
-    E.cx = E.selection_end_x;
-    E.cy = E.selection_end_y;
+/// @brief Find the first match in a row at or after column `from`
+ssize_t editorRowFind(erow* row, const char* q, int qlen, ssize_t from) {
+    if (from > row->size) return -1;
+    long pos = searchBytes(&row->chars[from], row->size - from, q, qlen);
+    return pos == -1 ? -1 : from + pos;
+}
 
-    for(int i = 0; i < numCharsToDelete; i++) {
-        editorDeleteChar();
+/// @brief Find the last match in a row starting before column `before`
+ssize_t editorRowFindLast(erow* row, const char* q, int qlen, ssize_t before) {
+    ssize_t found = -1;
+    ssize_t pos = editorRowFind(row, q, qlen, 0);
+    while (pos != -1 && pos < before) {
+        found = pos;
+        pos = editorRowFind(row, q, qlen, pos + 1);
     }
-    editorStopSelecting();
+    return found;
 }
 
-void editorSelectionIndent() {
-    //Tab on selection to mass-indent
-    editorCollectSelection();
-    editorRowInsertChar(&E.row[E.selection_start_y], E.selection_start_x, '\t');
+/// @brief Visit every row once from (*y, *x), wrapping around the buffer, to
+/// find the next match at or after that point (dir 1) or strictly before it (dir -1)
+/// @return 1 with *y, *x moved to the match, 0 if the buffer has no match
+int editorFindFrom(const char* q, int qlen, int dir, ssize_t* y, ssize_t* x) {
+    for (ssize_t n = 0; n <= E.numrows; n++) {
+        ssize_t at = ((*y + dir * n) % E.numrows + E.numrows) % E.numrows;
+        erow* row = editorRowAt(at);
+        ssize_t pos;
+
+        if (dir == 1) {
+            pos = editorRowFind(row, q, qlen, n == 0 ? *x : 0);
+            if (n == E.numrows && pos >= *x) pos = -1; // Wrapped back onto the start
+        } else {
+            pos = editorRowFindLast(row, q, qlen, n == 0 ? *x : row->size + 1);
+            if (n == E.numrows && pos < *x) pos = -1;
+        }
 
-    for(int i = 1; i <= E.selection_end_y - E.selection_start_y; i++)
-    {
-        editorRowInsertChar(&E.row[E.selection_start_y + i], E.selection_start_x, '\t');
+        if (pos != -1) {
+            *y = at;
+            *x = pos;
+            return 1;
+        }
     }
+    return 0;
 }
 
-void editorSelectionUnindent() {
-    editorCollectSelection();
+/*
+ * While the search prompt is open, a worker thread collects every match in
+ * the buffer into a sorted index, which the prompt uses for the match count,
+ * for highlighting the matches on screen & for stepping between them with a
+ * binary search. The buffer isn't edited while the prompt is open, & the
+ * worker is stopped before it closes, so it can read rows without locking.
+ */
+
+#define SEARCH_MAX_MATCHES (1 << 24) // Index size at which the scan gives up
+#define SEARCH_BATCH 4096            // Matches filtered between publications
+
+typedef struct searchMatch {
+    ssize_t y, x;
+} searchMatch;
+
+struct search {
+    char* query;
+    int qlen;
+
+    pthread_t worker;
+    pthread_mutex_t lock;
+    volatile int cancel;
+
+    // Guarded by lock. matches holds every match in rows [0, scanned), in order
+    searchMatch* matches;
+    int nmatches;
+    int cap;
+    ssize_t scanned;
+    int done;       // Every row has been scanned
+    int full;       // The scan stopped at SEARCH_MAX_MATCHES
+
+    // Handed to the worker: matches of a shorter prefix, covering rows [0, seed_scanned)
+    searchMatch* seed;
+    int nseed;
+    ssize_t seed_scanned;
+    int seed_done;
+
+    // Main thread only
+    ssize_t cur_y, cur_x; // Current match, cur_y is -1 if there is none
+    int pending;        // Direction of a step waiting on the scan, 0 if none
+    ssize_t from_y, from_x; // Where that step starts from
+};
 
-    int first_indent = E.selection_start_x == 0 ? 0 : E.selection_start_x - 1;
-    if(E.row[E.selection_start_y].chars[first_indent] == '\t') {
-        editorRowDeleteChar(&E.row[E.selection_start_y], first_indent);
+/// @brief Append matches to the index. Caller holds the lock.
+/// @return 0 if the index is full
+int searchPublish(struct search* s, searchMatch* batch, int n) {
+    if (s->nmatches + n > SEARCH_MAX_MATCHES) {
+        s->full = 1;
+        return 0;
     }
-
-    for(int i = 1; i <= E.selection_end_y - E.selection_start_y; i++)
-    {
-        if(E.row[E.selection_start_y + i].chars[0] == '\t') {
-            editorRowDeleteChar(&E.row[E.selection_start_y + i], 0);
+    if (s->nmatches + n > s->cap) {
+        int cap = s->cap ? s->cap : 1024;
+        while (cap < s->nmatches + n) cap *= 2;
+        searchMatch* m = realloc(s->matches, sizeof(searchMatch) * cap);
+        if (m == NULL) {
+            s->full = 1;
+            return 0;
         }
+        s->matches = m;
+        s->cap = cap;
     }
+    memcpy(&s->matches[s->nmatches], batch, sizeof(searchMatch) * n);
+    s->nmatches += n;
+    return 1;
 }
 
-/*** file IO ***/
+/// @brief Publish the worker's batch of matches along with how far the scan
+/// has got: every match in rows [0, scanned) is now in the index.
+/// @return 0 if the index is full
+int searchFlush(struct search* s, searchMatch* batch, int* n, ssize_t scanned) {
+    pthread_mutex_lock(&s->lock);
+    int ok = searchPublish(s, batch, *n);
+    if (ok) s->scanned = scanned;
+    pthread_mutex_unlock(&s->lock);
+    *n = 0;
+    return ok;
+}
 
-/// @brief calculate length of buffer & return buffer containing all rows
-/// @param buflen pointer to store buffer length into
-/// @return all rows in a single buffer
-char* editorRowsToString(int* buflen) {
-    int totlen = 0;
-    int j;
-    for(j = 0; j < E.numrows; j++) {
-        totlen += E.row[j].size + 1;
+void* searchWorker(void* arg) {
+    struct search* s = arg;
+    searchMatch batch[SEARCH_BATCH];
+    int n = 0, ok = 1;
+    long long span = profBegin();
+
+    // A longer query only matches where its prefix did, so filter those first
+    ssize_t start = 0;
+    rowblock* b = NULL;
+    for (int k = 0; ok && k < s->nseed && !s->cancel; k++) {
+        searchMatch m = s->seed[k];
+        if (m.y >= s->seed_scanned) break; // Part of a row the prefix hadn't finished
+        if (b == NULL || m.y >= start + b->numrows) b = rowblockFind(E.rows, m.y, &start);
+
+        erow* row = &b->rows[m.y - start];
+        if (m.x + s->qlen <= row->size && !memcmp(&row->chars[m.x], s->query, s->qlen))
+            batch[n++] = m;
+        if (n == SEARCH_BATCH) ok = searchFlush(s, batch, &n, m.y);
     }
-    *buflen = totlen;
+    if (ok && !s->cancel) ok = searchFlush(s, batch, &n, s->seed_scanned);
+
+    // Then scan whatever the prefix's search hadn't reached, a block at a time
+    ssize_t y = s->seed_scanned;
+    b = (ok && !s->seed_done) ? rowblockFind(E.rows, y, &start) : NULL;
+    while (b && ok && !s->cancel) {
+        for (int j = y - start; j < b->numrows; j++, y++) {
+            erow* row = &b->rows[j];
+            for (ssize_t pos = editorRowFind(row, s->query, s->qlen, 0); ok && pos != -1;
+                    pos = editorRowFind(row, s->query, s->qlen, pos + 1)) {
+                batch[n].y = y;
+                batch[n].x = pos;
+                if (++n == SEARCH_BATCH) ok = searchFlush(s, batch, &n, y);
+            }
+        }
+        if (ok) ok = searchFlush(s, batch, &n, y);
 
-    char* buf = malloc(totlen);
-    char* p = buf;
-    for(j = 0; j < E.numrows; j++) {
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
+        start += b->numrows;
+        b = rowblockNext(b);
     }
 
-    return buf;
+    if (ok && !s->cancel) {
+        pthread_mutex_lock(&s->lock);
+        s->done = 1;
+        pthread_mutex_unlock(&s->lock);
+    }
+    profEnd("search", "scan", span);
+    return NULL;
 }
 
-void editorOpen(char* filename) {
-    free(E.filename);
-    E.filename = strdup(filename);
+/// @brief Stop a search's worker, leaving its index as far as it got
+void searchHalt(struct search* s) {
+    s->cancel = 1;
+    pthread_join(s->worker, NULL);
+}
 
-    editorSelectSyntaxHighlight();
+void searchFree(struct search* s) {
+    pthread_mutex_destroy(&s->lock);
+    free(s->query);
+    free(s->matches);
+    free(s->seed);
+    free(s);
+}
 
-    FILE* fp = fopen(filename, "r");
-    if(!fp) fail("fopen");
+void editorSearchStop() {
+    if (E.search == NULL) return;
+    searchHalt(E.search);
+    searchFree(E.search);
+    E.search = NULL;
+    editorLoadPublish(); // Rows the loader found meanwhile can go in now
+}
 
-    char* line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    if(linelen != -1)
-    while((linelen = getline(&line, &linecap, fp)) != -1) {
-        while(linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-            linelen--;
-        editorInsertRow(E.numrows, line, linelen);
+/// @brief Start indexing the matches of a new query. When it extends the
+/// current query, the current index is handed over to be filtered.
+void editorSearchStart(char* query) {
+    struct search* old = E.search;
+    int qlen = strlen(query);
+
+    struct search* s = calloc(1, sizeof(struct search));
+    if (s == NULL) fail("calloc");
+    s->query = strdup(query);
+    if (s->query == NULL) fail("strdup");
+    s->qlen = qlen;
+    s->cur_y = -1;
+    pthread_mutex_init(&s->lock, NULL);
+
+    if (old) {
+        searchHalt(old);
+        if (qlen > old->qlen && !strncmp(query, old->query, old->qlen) && !old->full) {
+            s->seed = old->matches;
+            s->nseed = old->nmatches;
+            s->seed_scanned = old->scanned;
+            s->seed_done = old->done;
+            old->matches = NULL;
+        }
+        searchFree(old);
     }
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
+
+    E.search = s;
+    if (pthread_create(&s->worker, NULL, searchWorker, s) != 0) fail("pthread_create");
 }
 
-void editorSave() {
-    if (E.filename == NULL) {
-        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-        if (E.filename == NULL) {
-            editorSetStatusMessage("No filename given. Save aborted.");
-            return;
-        }
+/// @brief Index of the first match at or after (y, x). Caller holds the lock.
+int searchLowerBound(struct search* s, ssize_t y, ssize_t x) {
+    int lo = 0, hi = s->nmatches;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        searchMatch* m = &s->matches[mid];
+        if (m->y < y || (m->y == y && m->x < x)) lo = mid + 1;
+        else hi = mid;
     }
+    return lo;
+}
 
-    int len;
-    char* buf = editorRowsToString(&len);
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    if(fd != -1) {
-        if(ftruncate(fd, len) != -1) {
-            if(write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                E.dirty = 0;
-                editorSetStatusMessage("%d bytes written to disk.", len);
-                return;
-            }
-            editorSelectSyntaxHighlight();
+/// @brief Move to the first match at or after (y, x) (dir 1), or the last one
+/// strictly before it (dir -1), wrapping around the buffer. If the scan hasn't
+/// got that far yet, the step is retried as more of the index arrives.
+void editorSearchSeek(int dir, ssize_t y, ssize_t x) {
+    struct search* s = E.search;
+    int found = 0, wait = 0;
+    searchMatch m = {0, 0};
+
+    pthread_mutex_lock(&s->lock);
+    int k = searchLowerBound(s, y, x);
+    if (dir == 1) {
+        if (k < s->nmatches) {
+            m = s->matches[k];
+            found = 1;
+        } else if (s->done) {
+            if (s->nmatches) m = s->matches[0];
+            found = (s->nmatches > 0);
+        } else {
+            wait = 1;
         }
-        close(fd);
+    } else {
+        if (k > 0 && (y < s->scanned || s->done)) {
+            m = s->matches[k - 1];
+            found = 1;
+        } else if (s->done) {
+            if (s->nmatches) m = s->matches[s->nmatches - 1];
+            found = (s->nmatches > 0);
+        } else {
+            wait = 1;
+        }
+    }
+    int full = s->full;
+    pthread_mutex_unlock(&s->lock);
+
+    if (wait && full) {
+        // The index stopped short of here, so look directly
+        m.y = y;
+        m.x = x;
+        long long span = profBegin();
+        found = editorFindFrom(s->query, s->qlen, dir, &m.y, &m.x);
+        profEnd("search", "find", span);
+        wait = 0;
     }
 
-    free(buf);
-    editorSetStatusMessage("Write failed. IO error: %s", strerror(errno));
+    s->pending = wait ? dir : 0;
+    s->from_y = y;
+    s->from_x = x;
+    if (wait) return;
+
+    s->cur_y = found ? m.y : -1;
+    if (found) {
+        s->cur_x = m.x;
+        E.cy = m.y;
+        E.cx = m.x;
+        E.rowoff = E.numrows;
+    }
 }
 
-/*** find ***/
-
 void editorFindCallback(char* query, int key) {
-    static int last_match = -1;
-    static int direction = 1;
-
-    static int saved_hl_line;
-    static char* saved_hl = NULL;
-
-    if (saved_hl) {
-        memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-        free(saved_hl);
-        saved_hl = NULL;
-    }
+    struct search* s = E.search;
 
     if (key == '\r' || key == '\x1b') {
-        last_match = -1;
-        direction = 1;
+        editorSearchStop();
+        return;
+    } else if (key == NO_KEY) {
+        if (s && s->pending) editorSearchSeek(s->pending, s->from_y, s->from_x);
         return;
     } else if (key == RIGHT || key == DOWN) {
-        direction = 1;
+        if (s == NULL) return;
+        if (s->cur_y == -1) editorSearchSeek(1, 0, 0);
+        else editorSearchSeek(1, s->cur_y, s->cur_x + 1);
+        return;
     } else if (key == LEFT || key == UP) {
-        direction = -1;
-    } else {
-        last_match = -1;
-        direction = 1;
+        if (s == NULL) return;
+        if (s->cur_y == -1) editorSearchSeek(1, 0, 0);
+        else editorSearchSeek(-1, s->cur_y, s->cur_x);
+        return;
     }
 
-    if (last_match == -1) direction = 1;
-    int current = last_match;
+    if (query[0] == '\0') {
+        editorSearchStop();
+        return;
+    }
+    if (s && !strcmp(query, s->query)) return;
 
-    int i;
-    for (i = 0; i < E.numrows; i++) {
-        current += direction;
-        if (current == -1) current = E.numrows - 1;
-        else if (current == E.numrows) current = 0;
+    // Typing more of the query keeps the current match if it still matches
+    int grown = s && s->cur_y != -1 && !strncmp(query, s->query, s->qlen);
+    ssize_t y = grown ? s->cur_y : 0;
+    ssize_t x = grown ? s->cur_x : 0;
 
-        erow *row = &E.row[current];
-        char *match = strstr(row->render, query);
-        if (match) {
-            last_match = current;
-            E.cy = current;
-            E.cx = editorRowRxToCx(row, match - row->render);
-            E.rowoff = E.numrows;
+    editorSearchStart(query);
+    editorSearchSeek(1, y, x);
+}
 
-            saved_hl_line = current;
-            saved_hl = malloc(row->rsize);
-            memcpy(saved_hl, row->hl, row->rsize);
+/// @brief Describe the current match's place in the index, e.g. "3 of 12"
+void editorSearchStatus(char* buf, size_t size) {
+    struct search* s = E.search;
 
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-            break;
-        }
-    }
+    pthread_mutex_lock(&s->lock);
+    int k = searchLowerBound(s, s->cur_y, s->cur_x);
+    int known = (s->cur_y != -1 && k < s->nmatches &&
+        s->matches[k].y == s->cur_y && s->matches[k].x == s->cur_x);
+    int n = s->nmatches, done = s->done;
+    pthread_mutex_unlock(&s->lock);
+
+    if (done && n == 0) snprintf(buf, size, "No matches");
+    else if (known) snprintf(buf, size, "%d of %d%s", k + 1, n, done ? "" : "+");
+    else snprintf(buf, size, "%d%s matches", n, done ? "" : "+");
 }
 
 void editorFind() {
-    int saved_cx = E.cx;
-    int saved_cy = E.cy;
-    int saved_coloff = E.coloff;
-    int saved_rowoff = E.rowoff;
+    ssize_t saved_cx = E.cx;
+    ssize_t saved_cy = E.cy;
+    ssize_t saved_coloff = E.coloff;
+    ssize_t saved_rowoff = E.rowoff;
 
     char* query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
 
@@ -919,24 +3792,254 @@ void editorFind() {
 
 /*** append buffer ***/
 
+/*
+ * An abuf keeps its memory between uses & grows geometrically, so a buffer
+ * that is reset & refilled every frame stops allocating once it has seen
+ * the largest frame.
+ */
+
 struct abuf {
     char* b;
-    int len
+    int len;
+    int cap;
+    int allocs; // Reallocations since the last reset
 };
 
-#define ABUF_INIT {NULL, 0} // Empty buffer
+#define ABUF_INIT {NULL, 0, 0, 0} // Empty buffer
 
-void abAppend(struct abuf* ab, const char* s, int len) {
-    char* new = realloc(ab->b, ab->len + len);
+/// @brief Make room for len more bytes & return where they go
+char* abReserve(struct abuf* ab, int len) {
+    if (ab->len + len > ab->cap) {
+        int cap = ab->cap ? ab->cap * 2 : 4096;
+        while (cap < ab->len + len) cap *= 2;
 
-    if (new == NULL) return;
-    memcpy(&new[ab->len], s, len);
-    ab->b = new;
+        char* new = realloc(ab->b, cap);
+        if (new == NULL) return NULL;
+        ab->b = new;
+        ab->cap = cap;
+        ab->allocs++;
+    }
+
+    char* p = &ab->b[ab->len];
     ab->len += len;
+    return p;
+}
+
+void abAppend(struct abuf* ab, const char* s, int len) {
+    char* p = abReserve(ab, len);
+    if (p) memcpy(p, s, len);
+}
+
+/// @brief Append the glyphs of a run of cells
+void abAppendCells(struct abuf* ab, const cell* cells, int n) {
+    char* p = abReserve(ab, n);
+    if (p == NULL) return;
+    for (int j = 0; j < n; j++) p[j] = cells[j].ch;
+}
+
+/// @brief Empty the buffer, keeping its memory
+void abReset(struct abuf* ab) {
+    ab->len = 0;
+    ab->allocs = 0;
+}
+
+/// @brief Write the whole buffer to fd, resuming after partial writes
+int abWrite(struct abuf* ab, int fd) {
+    int done = 0;
+    while (done < ab->len) {
+        ssize_t n = write(fd, &ab->b[done], ab->len - done);
+        if (n == -1) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
 }
 
 void abFree(struct abuf* ab) {
     free(ab->b);
+    ab->b = NULL;
+    ab->len = ab->cap = 0;
+}
+
+/*** frame ***/
+
+/*
+ * Output is drawn into E.frame, a grid of cells, which is then compared with
+ * E.shown, the grid already on the terminal. Only the runs of cells that
+ * differ are sent, each preceded by a cursor move, so a keystroke costs a
+ * few bytes rather than a repaint of the whole screen.
+ */
+
+#define FRAME_GAP 4 // Unchanged cells worth resending to avoid a cursor move
+
+cell* frameRow(int y) {
+    return &E.frame[y * E.screencols];
+}
+
+/// @brief (Re)allocate both grids for the current screen size
+void frameResize() {
+    size_t n = (size_t)(E.screenrows + 2) * E.screencols;
+    E.frame = realloc(E.frame, sizeof(cell) * n);
+    E.shown = realloc(E.shown, sizeof(cell) * n);
+    if (n && (E.frame == NULL || E.shown == NULL)) fail("realloc");
+    E.shown_valid = 0;
+}
+
+void frameFill(int y, int fg, int attr) {
+    cell* r = frameRow(y);
+    for (int x = 0; x < E.screencols; x++) {
+        r[x].ch = ' ';
+        r[x].fg = fg;
+        r[x].attr = attr;
+    }
+}
+
+void framePut(int y, int x, char ch, int fg, int attr) {
+    if (x < 0 || x >= E.screencols) return;
+    cell* c = &frameRow(y)[x];
+    c->ch = ch;
+    c->fg = fg;
+    c->attr = attr;
+}
+
+void frameWrite(int y, int x, const char* s, int len, int fg, int attr) {
+    for (int j = 0; j < len; j++) framePut(y, x + j, s[j], fg, attr);
+}
+
+/// @brief Recolour the cells [x, x + len) of a row, keeping their characters
+void frameMark(int y, int x, int len, int fg, int attr) {
+    if (x < 0) {
+        len += x;
+        x = 0;
+    }
+    if (x + len > E.screencols) len = E.screencols - x;
+    cell* c = &frameRow(y)[x];
+    for (int j = 0; j < len; j++) {
+        c[j].fg = fg;
+        c[j].attr |= attr;
+    }
+}
+
+int cellEqual(cell* a, cell* b) {
+    return a->ch == b->ch && a->fg == b->fg && a->attr == b->attr;
+}
+
+int cellBlank(cell* c) {
+    return c->ch == ' ' && c->fg == CELL_FG_DEFAULT && c->attr == 0;
+}
+
+void abAppendSGR(struct abuf* ab, int fg, int attr) {
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[0");
+    if (fg != CELL_FG_DEFAULT) len += snprintf(&buf[len], sizeof(buf) - len, ";%d", fg);
+    if (attr & CELL_REVERSE) len += snprintf(&buf[len], sizeof(buf) - len, ";7");
+    if (attr & CELL_SELECTED) len += snprintf(&buf[len], sizeof(buf) - len, ";43");
+    buf[len++] = 'm';
+    abAppend(ab, buf, len);
+}
+
+void abAppendMove(struct abuf* ab, int y, int x) {
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+    abAppend(ab, buf, len);
+}
+
+/// @brief Append the escape sequences turning E.shown into E.frame
+void editorFlushFrame(struct abuf* ab) {
+    int rows = E.screenrows + 2;
+    int cols = E.screencols;
+    int cy = -1, cx = -1;   // Terminal cursor, -1 when unknown
+    int fg = CELL_FG_DEFAULT, attr = 0; // Every flush leaves the attributes reset
+
+    if (!E.shown_valid) {
+        abAppend(ab, "\x1b[m\x1b[H\x1b[2J", 10);
+        for (int y = 0; y < rows; y++) {
+            cell* r = &E.shown[y * cols];
+            for (int x = 0; x < cols; x++) {
+                r[x].ch = ' ';
+                r[x].fg = CELL_FG_DEFAULT;
+                r[x].attr = 0;
+            }
+        }
+        cy = cx = 0;
+        E.shown_valid = 1;
+    }
+
+    for (int y = 0; y < rows; y++) {
+        cell* now = frameRow(y);
+        cell* old = &E.shown[y * cols];
+        if (!memcmp(now, old, sizeof(cell) * cols)) continue;
+
+        // Multibyte characters don't occupy one column per byte, so rows
+        // holding them are rewritten whole instead of patched by column
+        int wide = 0;
+        for (int x = 0; x < cols; x++) {
+            if ((unsigned char)now[x].ch >= 0x80 || (unsigned char)old[x].ch >= 0x80) {
+                wide = 1;
+                break;
+            }
+        }
+
+        int last = cols - 1;
+        while (last >= 0 && cellBlank(&now[last])) last--;
+
+        int x = 0;
+        while (x <= last) {
+            if (!wide && cellEqual(&now[x], &old[x])) {
+                x++;
+                continue;
+            }
+
+            int end = x + 1, gap = 0;
+            for (int k = x + 1; k <= last && gap <= FRAME_GAP; k++) {
+                if (wide || !cellEqual(&now[k], &old[k])) {
+                    end = k + 1;
+                    gap = 0;
+                } else {
+                    gap++;
+                }
+            }
+
+            if (cy != y || cx != x) abAppendMove(ab, y, x);
+            for (int k = x; k < end;) {
+                if (now[k].fg != fg || now[k].attr != attr) {
+                    fg = now[k].fg;
+                    attr = now[k].attr;
+                    abAppendSGR(ab, fg, attr);
+                }
+
+                int n = 1;
+                while (k + n < end && now[k + n].fg == fg && now[k + n].attr == attr) n++;
+                abAppendCells(ab, &now[k], n);
+                k += n;
+            }
+            cy = y;
+            cx = (end < cols && !wide) ? end : -1; // The last column leaves a pending wrap
+            x = end;
+        }
+
+        int dirty_tail = wide;
+        for (int k = last + 1; k < cols && !dirty_tail; k++) {
+            if (!cellBlank(&old[k])) dirty_tail = 1;
+        }
+        if (dirty_tail && last + 1 < cols) {
+            if (cy != y || cx != last + 1) abAppendMove(ab, y, last + 1);
+            if (fg != CELL_FG_DEFAULT || attr != 0) {
+                fg = CELL_FG_DEFAULT;
+                attr = 0;
+                abAppendSGR(ab, fg, attr);
+            }
+            abAppend(ab, "\x1b[K", 3);
+            cy = y;
+            cx = wide ? -1 : last + 1;
+        }
+
+        memcpy(old, now, sizeof(cell) * cols);
+    }
+
+    if (fg != CELL_FG_DEFAULT || attr != 0) abAppend(ab, "\x1b[m", 3);
 }
 
 /*** output ***/
@@ -944,7 +4047,7 @@ void abFree(struct abuf* ab) {
 void editorScroll() {
     E.rx = 0;
     if (E.cy < E.numrows) {
-        E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+        E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
     }
 
     if (E.cy < E.rowoff) {
@@ -961,150 +4064,187 @@ void editorScroll() {
     }
 }
 
-void editorDrawRows(struct abuf *ab) {
+void editorDrawRows() {
+    // Matches of an open search, read from its index as far as it has got
+    struct search* s = E.search;
+    int k = 0;
+    if (s) {
+        pthread_mutex_lock(&s->lock);
+        k = searchLowerBound(s, E.rowoff, 0);
+    }
+
     int y;
     for (y = 0; y < E.screenrows; y++) {
-        int filerow = y + E.rowoff;
+        ssize_t filerow = y + E.rowoff;
+        frameFill(y, CELL_FG_DEFAULT, 0);
 
         if(filerow >= E.numrows) {
-            if (E.numrows == 0 && y == E.screenrows / 3) {
+            if (E.numrows == 0 && E.loader == NULL && y == E.screenrows / 3) {
                 char welcome[80]; // Welcome message buffer
                 int welcomelen = snprintf(welcome, sizeof(welcome), "Flit editor -- version %s", VERSION);
                 if (welcomelen > E.screencols) welcomelen = E.screencols;
 
                 // Padding
                 int padding = (E.screencols - welcomelen) / 2;
-                if (padding) {
-                    abAppend(ab, "~", 1);
-                    padding--;
-                }
-                while (padding--) abAppend(ab, " ", 1);
+                if (padding) framePut(y, 0, '~', CELL_FG_DEFAULT, 0);
 
-                abAppend(ab, welcome, welcomelen);
+                frameWrite(y, padding, welcome, welcomelen, CELL_FG_DEFAULT, 0);
             } else {
-                abAppend(ab, "~", 1); // Prefix for unused line
+                framePut(y, 0, '~', CELL_FG_DEFAULT, 0); // Prefix for unused line
             }
         } else { // The line is in the used section of the editor.
-            int len = E.row[filerow].rsize - E.coloff;
+            erow* row = editorPrepareRow(filerow);
+            ssize_t len = row->rsize - E.coloff;
             if (len < 0) len = 0;
             if (len > (E.screencols - MARGIN)) len = (E.screencols - MARGIN);
             
-            char* c = &E.row[filerow].render[E.coloff];
-            unsigned char* hl = &E.row[filerow].hl[E.coloff];
-            int current_color = -1;
+            char* c = &editorRowRender(row)[E.coloff];
+
+            // hl runs from the one holding E.coloff on, HL_NORMAL past the last
+            hlSpan* spans = editorRowSpans(row);
+            ssize_t span = 0, span_end = 0;
+            while (span < row->nspans && span_end + spans[span].len <= E.coloff)
+                span_end += spans[span++].len;
 
             // margin line numbers
-            char margin[7];
-            margin[6] = '\0'; // Null terminate
-            sprintf(margin, "%4d| ", filerow); // padding
-            abAppend(ab, margin, 6);
+            char margin[24]; // Room for any row number, though only MARGIN columns show
+            snprintf(margin, sizeof(margin), "%4zd| ", filerow); // padding
+            frameWrite(y, 0, margin, MARGIN, CELL_FG_DEFAULT, 0);
+
+            // Selected span of this row, in render columns
+            ssize_t sel_from = 0, sel_to = 0;
+            if (E.selecting && filerow >= E.selection_start_y && filerow <= E.selection_end_y) {
+                sel_to = row->rsize;
+                if (filerow == E.selection_start_y) sel_from = editorRowCxToRx(row, E.selection_start_x);
+                if (filerow == E.selection_end_y) sel_to = editorRowCxToRx(row, E.selection_end_x);
+            }
 
             int j;
             for(j = 0; j < len; j++) {
-                // Selection
-                if(E.selecting) {
-                    // editorSetStatusMessage("Selection: %d/%d -> %d/%d", E.selection_start_x, E.selection_start_y, E.selection_end_x, E.selection_end_y);
-                    
-                    // Check if current character is within selection bounds
-                    if((filerow > E.selection_start_y || (filerow == E.selection_start_y && j >= E.selection_start_x)) &&
-                    (filerow < E.selection_end_y || (filerow == E.selection_end_y && j < E.selection_end_x))) {
-                        abAppend(ab, "\033[43m", 5);
-                    } else if (filerow == E.selection_end_y && j == E.selection_end_x) {
-                        abAppend(ab, "\033[0m", 4); // Final character in selection resets highlighting. (Should come after the character)
-                    }
-                }
+                ssize_t rx = j + E.coloff;
+                int attr = (rx >= sel_from && rx < sel_to) ? CELL_SELECTED : 0;
+
+                while (span < row->nspans && rx >= span_end + spans[span].len)
+                    span_end += spans[span++].len;
+                int hl = span < row->nspans ? spans[span].hl : HL_NORMAL;
 
                 if (iscntrl(c[j])) {
                     char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-                    abAppend(ab, "\x1b[7m", 4);
-                    abAppend(ab, &sym, 1);
-                    abAppend(ab, "\x1b[m", 3);
-                    if (current_color != -1) {
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-                        abAppend(ab, buf, clen);
-                    }
-                } else if (hl[j] == HL_NORMAL) {
-                    if(current_color != -1) {
-                        abAppend(ab, "\x1b[39m", 5);
-                        current_color = -1;
-                    }
-                    abAppend(ab, &c[j], 1);
+                    framePut(y, MARGIN + j, sym, CELL_FG_DEFAULT, attr | CELL_REVERSE);
+                } else if (hl == HL_NORMAL) {
+                    framePut(y, MARGIN + j, c[j], CELL_FG_DEFAULT, attr);
                 } else {
-                    int color = editorSyntaxToColor(hl[j]);
-                    if (color != current_color) {
-                        current_color = color;
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                        abAppend(ab, buf, clen);
-                    }
-                    abAppend(ab, &c[j], 1);
+                    framePut(y, MARGIN + j, c[j], editorSyntaxToColor(hl), attr);
                 }
             }
-            abAppend(ab, "\033[0m", 4); // Reset Highlighting
-            abAppend(ab, "\x1b[39m", 5); // Reset Colour
-        }
 
-        abAppend(ab, "\x1b[K", 3); // Clearing screen by "Erasing in line"
-        abAppend(ab, "\r\n", 2);
-        
+            for (; s && k < s->nmatches && s->matches[k].y == filerow; k++) {
+                searchMatch* m = &s->matches[k];
+                ssize_t rx = editorRowCxToRx(row, m->x);
+                ssize_t rlen = editorRowCxToRx(row, m->x + s->qlen) - rx;
+                if (rx + rlen <= E.coloff || rx >= E.coloff + E.screencols) continue;
+                int current = (m->y == s->cur_y && m->x == s->cur_x);
+                frameMark(y, MARGIN + rx - E.coloff, rlen, editorSyntaxToColor(HL_MATCH),
+                    current ? CELL_REVERSE : 0);
+            }
+        }
     }
+
+    if (s) pthread_mutex_unlock(&s->lock);
 }
 
-void editorDrawStatusBar(struct abuf *ab) {
-    abAppend(ab, "\x1b[7m", 4);
+void editorDrawStatusBar() {
+    int y = E.screenrows;
+    frameFill(y, CELL_FG_DEFAULT, CELL_REVERSE);
 
-    char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-        E.filename ? E.filename : "[No Name]", E.numrows,
+    char status[80], rstatus[80], loading[24] = "";
+    if (E.loader) {
+        snprintf(loading, sizeof(loading), " (loading %d%%)",
+            (int)(E.loader->published * 100 / E.map_len));
+    }
+    int len = snprintf(status, sizeof(status), "%.20s - %zd lines%s %s",
+        E.filename ? E.filename : "[No Name]", E.numrows, loading,
         E.dirty ? "(modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
+    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %zd/%zd",
         E.syntax ? E.syntax->filetype : ".?", E.cy + 1, E.numrows);
     if (len > E.screencols) len = E.screencols;
-    abAppend(ab, status, len);
-    
-    while (len < E.screencols) {
-        if (E.screencols - len == rlen) {
-            abAppend(ab, rstatus, rlen);
-            break;
-        } else {
-            abAppend(ab, " ", 1);
-            len++;
-        }
-    }
-    abAppend(ab, "\x1b[m", 3);
-    abAppend(ab, "\r\n", 2);
+    frameWrite(y, 0, status, len, CELL_FG_DEFAULT, CELL_REVERSE);
+
+    if (E.screencols - len >= rlen)
+        frameWrite(y, E.screencols - rlen, rstatus, rlen, CELL_FG_DEFAULT, CELL_REVERSE);
+}
+
+/// @brief Describe the last frame & the memory rows hold, for the HUD
+void editorHudStatus(char* buf, size_t size) {
+    long long last, p99;
+    profFrameTimes(&last, &p99);
+
+    // Rows, what they derive from their chars & the storage of their chars
+    ssize_t bytes = E.numrows * sizeof(erow) + row_aux_bytes + line_store.large_bytes;
+    for (int cls = 0; cls < LINE_CLASSES; cls++)
+        bytes += line_store.classes[cls].slabs * LINE_SLAB_SIZE;
+
+    snprintf(buf, size, "frame %.2f ms, p99 %.2f ms | %d B | rows %.1f MiB",
+        last / 1e6, p99 / 1e6, E.frame_bytes, bytes / (double)(1 << 20));
 }
 
-void editorDrawMessageBar(struct abuf *ab) {
-    abAppend(ab, "\x1b[K", 3);
+void editorDrawMessageBar() {
+    int y = E.screenrows + 1;
+    frameFill(y, CELL_FG_DEFAULT, 0);
+
     int msglen = strlen(E.statusmsg);
     if (msglen > E.screencols) msglen = E.screencols;
     if (msglen && time(NULL) - E.statusmsg_time < 5)
-        abAppend(ab, E.statusmsg, msglen);
+        frameWrite(y, 0, E.statusmsg, msglen, CELL_FG_DEFAULT, 0);
+
+    // The search's progress & the HUD go on the right, the HUD last
+    char right[128] = "";
+    if (E.search) editorSearchStatus(right, 48);
+    if (prof.hud) {
+        int len = strlen(right);
+        if (len) len += snprintf(&right[len], sizeof(right) - len, " | ");
+        editorHudStatus(&right[len], sizeof(right) - len);
+    }
+
+    int rlen = strlen(right);
+    if (rlen && E.screencols - msglen > rlen)
+        frameWrite(y, E.screencols - rlen, right, rlen, CELL_FG_DEFAULT, 0);
 }
 
+struct abuf screen_ab = ABUF_INIT; // Output of every refresh, kept between frames
+
 void editorRefreshScreen() {
+    long long start = profNow();
+    if (map_truncated) {
+        map_truncated = 0;
+        editorSetStatusMessage("File truncated on disk: the text it lost reads as NULs");
+    }
     editorScroll();
 
-    struct abuf ab = ABUF_INIT;
-    abAppend(&ab, "\033[H\033[J", 6); // Clear the screen.
-    abAppend(&ab, "\x1b[?25l", 6);
-    abAppend(&ab, "\x1b[H", 3); // Position the cursor to home: (3 bytes)
-
-    editorDrawRows(&ab);
-    editorDrawStatusBar(&ab);
-    editorDrawMessageBar(&ab);
-
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1 + MARGIN); // Cursor position
-    abAppend(&ab, buf, strlen(buf));
-
-    abAppend(&ab, "\x1b[?25h", 6);
-
-    write(STDOUT_FILENO, ab.b, ab.len);
-    abFree(&ab);
-
+    long long span = profBegin();
+    editorDrawRows();
+    profEnd("render", "draw rows", span);
+    editorDrawStatusBar();
+    editorDrawMessageBar();
+
+    struct abuf* ab = &screen_ab;
+    abReset(ab);
+    abAppend(ab, "\x1b[?25l", 6);
+    span = profBegin();
+    editorFlushFrame(ab);
+    profEnd("render", "flush", span);
+
+    abAppendMove(ab, E.cy - E.rowoff, (E.rx - E.coloff) + MARGIN); // Cursor position
+    abAppend(ab, "\x1b[?25h", 6);
+
+    span = profBegin();
+    abWrite(ab, STDOUT_FILENO);
+    profEnd("render", "write", span);
+    E.frame_bytes = ab->len;
+    E.frame_allocs = ab->allocs;
+
+    profEnd("render", "refresh", prof.trace ? start : 0);
+    profFrame(start);
 }
 
 void editorSetStatusMessage(const char* fmt, ...) {
@@ -1128,17 +4268,23 @@ char* editorPrompt(char* promt, void (*callback)(char*, int)){
         editorSetStatusMessage(promt, buf);
         editorRefreshScreen();
 
-        int c = editorReadKey();
+        // Time out now & then so the callback can show background progress
+        int c = editorPollKey();
+        if (c == NO_KEY) {
+            if (callback) callback(buf, c);
+            continue;
+        }
+
         if (c == DEL || c == CTRL_KEY('h') || c == BACKSPACE) {
             if (buflen != 0) buf[--buflen] = '\0';
         } else if (c == '\x1b') {
-            editorSetStatusMessage("");
+            E.statusmsg[0] = '\0';
             if (callback) callback(buf, c);
             free(buf);
             return NULL;
         } else if (c == '\r') {
             if (buflen != 0) {
-                editorSetStatusMessage("");
+                E.statusmsg[0] = '\0';
                 if (callback) callback(buf, c);
                 return buf;
             }
@@ -1149,6 +4295,17 @@ char* editorPrompt(char* promt, void (*callback)(char*, int)){
             }
             buf[buflen++] = c;
             buf[buflen] = '\0';
+        } else if (c == PASTE) {
+            // Take the first line of the pasted text
+            for (ssize_t j = 0; j < E.paste_len && E.paste[j] != '\n'; j++) {
+                if (iscntrl(E.paste[j])) continue;
+                if (buflen == bufsize - 1) {
+                    bufsize *= 2;
+                    buf = realloc(buf, bufsize);
+                }
+                buf[buflen++] = E.paste[j];
+                buf[buflen] = '\0';
+            }
         }
 
         if (callback) callback(buf, c);
@@ -1161,7 +4318,7 @@ void editorDropCursor() {
 }
 
 void editorMoveCursor(int key) { 
-    erow* row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    erow* row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy);
 
     switch (key) {
         case LEFT:
@@ -1169,13 +4326,13 @@ void editorMoveCursor(int key) {
                 E.cx--;
             } else if (E.cy > 0) {
                 E.cy--;
-                E.cx = E.row[E.cy].size;
+                E.cx = editorRowAt(E.cy)->size;
             }
             break;
         case RIGHT:
             if (row && E.cx < row->size) {
                 E.cx++;
-            } else if (row && E.cx == row->size) {
+            } else if (row && E.cx == row->size && E.cy < editorLastLine()) {
                 E.cy++;
                 E.cx = 0;
             }
@@ -1184,12 +4341,12 @@ void editorMoveCursor(int key) {
             if (E.cy != 0) E.cy--;
             break;
         case DOWN:
-            if (E.cy < E.numrows) E.cy++;
+            if (E.cy < editorLastLine()) E.cy++;
             break;
     }
 
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
-    int rowlen = row ? row->size : 0;
+    row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy);
+    ssize_t rowlen = row ? row->size : 0;
     if (E.cx > rowlen) {
         E.cx = rowlen;
     }
@@ -1202,6 +4359,8 @@ void editorMoveCursor(int key) {
 /// @brief Awaits keypress, then handles it.
 void editorHandleKeyPress() {
     int c = editorReadKey();
+    profKey();
+    long long span = profBegin();
 
     switch (c) {
         case '\r':
@@ -1209,7 +4368,8 @@ void editorHandleKeyPress() {
             break;
 
         case CTRL_KEY('q'):
-            if (E.copy_buffer != NULL) {free(E.copy_buffer);}
+            journalClose(1);
+            editorCopyClear();
             write(STDOUT_FILENO, "\x1b[2J", 4);
             write(STDERR_FILENO, "\x1b[H", 3);
 
@@ -1250,8 +4410,10 @@ void editorHandleKeyPress() {
             if(E.selecting) {
                 editorSelectionDelete();
             } else {
+                ssize_t cx = E.cx, cy = E.cy;
                 if(c == DEL) editorMoveCursor(RIGHT);
-                editorDeleteChar();
+                // Nothing follows the cursor at the end of the rows loaded so far
+                if (c != DEL || E.cx != cx || E.cy != cy) editorDeleteChar();
             }
             break;
 
@@ -1261,7 +4423,7 @@ void editorHandleKeyPress() {
                 E.cy = E.rowoff;
             } else if (c == P_DOWN) {
                 E.cy = E.rowoff + E.screenrows - 1;
-                if (E.cy > E.numrows) E.cy = E.numrows;
+                if (E.cy > editorLastLine()) E.cy = editorLastLine();
             }
 
             int times = E.screenrows;
@@ -1279,7 +4441,26 @@ void editorHandleKeyPress() {
             editorMoveCursor(c);
             break;
 
-        case CTRL_KEY('l'): // We already refresh
+        case PASTE:         // Text pasted into the terminal goes in as one edit
+            if (E.selecting) {
+                editorSelectionDelete();
+            }
+
+            if (E.paste_len) editorInsertText(E.paste, E.paste_len);
+            break;
+
+        case CTRL_KEY('l'): // Repaint the whole screen on the next refresh
+            E.shown_valid = 0;
+            break;
+
+        case CTRL_KEY('t'): // Report how row text is being stored
+            lineStoreReport();
+            break;
+
+        case CTRL_KEY('p'): // Show frame times & memory in the message bar
+            prof.hud = !prof.hud;
+            break;
+
         case '\x1b':        // Ignoring Escape Key
             break;
 
@@ -1321,6 +4502,7 @@ void editorHandleKeyPress() {
             break;
         
     }
+    profEnd("input", "key", span);
 }
 
 /*** init ***/
@@ -1332,13 +4514,21 @@ void initEditor() {
     E.rowoff = 0;
     E.coloff = 0;
     E.numrows = 0;
-    E.row = NULL;
+    E.rows = NULL;
+    E.row_cache = NULL;
+    E.row_cache_start = 0;
+    E.hl_stale_from = 0;
     E.dirty = 0;
 
     E.filename = NULL;
+    E.map = NULL;
+    E.map_len = 0;
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
     E.syntax = NULL;
+    E.search = NULL;
+    E.journal = NULL;
+    E.loader = NULL;
 
     E.dropped_cursor_x = 0;
     E.dropped_cursor_y = 0;
@@ -1347,26 +4537,54 @@ void initEditor() {
     E.selection_end_x = 0;
     E.selection_end_y = 0;
     E.selecting = 0;
-    E.copy_buffer = NULL;
-    E.copy_buffer_len = 0;
+    E.copy = (copyBuffer){NULL, 0, 0, 0, NULL, 0, 0, 1};
 
     if (getWindowSize(&E.screenrows, &E.screencols) == -1) fail("getWindowSize");
     E.screenrows-=2;
+
+    E.frame = NULL;
+    E.shown = NULL;
+    E.frame_bytes = 0;
+    E.frame_allocs = 0;
+    frameResize();
+    profOpen();
+
+    E.input_pos = 0;
+    E.input_len = 0;
+    E.paste = NULL;
+    E.paste_len = 0;
+    E.paste_cap = 0;
+    if (pipe(E.resize_pipe) == -1) fail("pipe");
+    fcntl(E.resize_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(E.resize_pipe[1], F_SETFL, O_NONBLOCK);
+    if (pipe(E.load_pipe) == -1) fail("pipe");
+    fcntl(E.load_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(E.load_pipe[1], F_SETFL, O_NONBLOCK);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handleSigwinch;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGWINCH, &sa, NULL) == -1) fail("sigaction");
 }
 
 int main(int argc, char *argv[]) {
     enableRawMode();
     initEditor();
 
+    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-F = find | Ctrl-Q = quit");
+
     if(argc >= 2) {
         editorOpen(argv[1]);
     }
 
-    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-F = find | Ctrl-Q = quit");
-
     while(1) {
         editorRefreshScreen();
-        editorHandleKeyPress();
+
+        // Apply every key already waiting before drawing again
+        do {
+            editorHandleKeyPress();
+        } while (editorKeyPending());
     }
 
     return 0;